@@ -0,0 +1,370 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chip8.h"
+#include <alloc.h>
+#include <dialogs.h>
+#include <gray.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * ch8ti("bench") runs each of the programs below for BENCH_TICKS timer ticks
+ * and reports how many instructions and draws per second this calculator
+ * manages. Each program is a tight loop around one part of the emulator, so
+ * that results can be compared between models and AMS versions.
+ *
+ * ch8ti("bench", "kernels") instead times the drawing, scrolling and
+ * decompression routines on their own, calling each directly with inputs
+ * that cycle through every x alignment and sprite height. Each kernel is run
+ * KERNEL_REPEATS times, and reported as its mean time per call along with
+ * how far the runs strayed from it.
+ *
+ * Rates are worked out from the timer interrupt, which runs at 58.8hz with
+ * the PRG settings used by ch8_start().
+ */
+#define BENCH_TICKS 120
+#define BENCH_HZ_X10 588
+#define KERNEL_TICKS 20
+#define KERNEL_REPEATS 5
+
+struct bench_rom {
+	const char *name;
+	_Bool draws;
+	uint8_t len;
+	const uint8_t code[16];
+};
+
+static const struct bench_rom ROM_BENCHES[] = {
+	{
+		// V1 += 1; V0 += V1; V2 = V0 >> 1; V1 ^= V2
+		.name = "ALU",
+		.len = 12,
+		.code = { 0x60, 0x01, 0x71, 0x01, 0x80, 0x14, 0x82, 0x06, 0x81,
+			  0x23, 0x12, 0x02 },
+	},
+	{
+		// Draws the 0 glyph, moving it around the screen.
+		.name = "Draw lo",
+		.draws = TRUE,
+		.len = 10,
+		.code = { 0xA0, 0x00, 0xD0, 0x15, 0x70, 0x03, 0x71, 0x02, 0x12,
+			  0x02 },
+	},
+	{
+		// Draws a 16x16 sprite in hi-res mode, moving it around.
+		.name = "Draw hi",
+		.draws = TRUE,
+		.len = 12,
+		.code = { 0x00, 0xFF, 0xA0, 0x50, 0xD0, 0x10, 0x70, 0x05, 0x71,
+			  0x03, 0x12, 0x04 },
+	},
+	{
+		.name = "Scroll",
+		.len = 10,
+		.code = { 0x00, 0xFF, 0x00, 0xC4, 0x00, 0xFB, 0x00, 0xFC, 0x12,
+			  0x02 },
+	},
+	{
+		// Fx55 and Fx65 move I, so it is reset every time around.
+		.name = "Fx55/Fx65",
+		.len = 8,
+		.code = { 0xA3, 0x00, 0xFF, 0x55, 0xFF, 0x65, 0x12, 0x00 },
+	},
+	{
+		// Polls each key in turn with Ex9E and ExA1.
+		.name = "Keys",
+		.len = 14,
+		.code = { 0x61, 0x0F, 0xE0, 0x9E, 0x70, 0x01, 0xE0, 0xA1, 0x70,
+			  0x01, 0x80, 0x12, 0x12, 0x02 },
+	},
+};
+
+#define BENCH_COUNT (sizeof(ROM_BENCHES) / sizeof(ROM_BENCHES[0]))
+
+static const uint16_t KERNEL_SPRITE[16] = {
+	0xFFFF, 0xAAAA, 0x5555, 0xF0F0, 0x0F0F, 0xCCCC, 0x3333, 0xFF00,
+	0x00FF, 0x8001, 0x4002, 0x2004, 0x1008, 0x0810, 0x0420, 0x0240,
+};
+
+// Compressed screen for the decompression kernel, and room to unpack it.
+static uint8_t *kernel_packed;
+static uint16_t kernel_packed_len;
+static uint8_t *kernel_unpacked;
+
+static void kernel_draw_16_hi(uint16_t i)
+{
+	draw_sprite_16_hi(C8_PLANE_BOTH, KERNEL_SPRITE, i & 0x7F,
+			  (i >> 3) & 0x3F, 16);
+}
+
+static void kernel_draw_8_hi(uint16_t i)
+{
+	draw_sprite_8_hi(C8_PLANE_BOTH, (const uint8_t *)KERNEL_SPRITE,
+			 i & 0x7F, (i >> 3) & 0x3F, 1 + i % 15);
+}
+
+static void kernel_draw_16_lo(uint16_t i)
+{
+	draw_sprite_16_lo(C8_PLANE_BOTH, KERNEL_SPRITE, i & 0x3F,
+			  (i >> 3) & 0x1F, 16);
+}
+
+static void kernel_draw_8_lo(uint16_t i)
+{
+	draw_sprite_8_lo(C8_PLANE_BOTH, (const uint8_t *)KERNEL_SPRITE,
+			 i & 0x3F, (i >> 3) & 0x1F, 1 + i % 15);
+}
+
+static void kernel_scroll_right_one(uint16_t i)
+{
+	(void)i;
+	ch8_scroll_right(C8_PLANE_LIGHT);
+}
+
+static void kernel_scroll_right(uint16_t i)
+{
+	(void)i;
+	ch8_scroll_right(C8_PLANE_BOTH);
+}
+
+static void kernel_scroll_left(uint16_t i)
+{
+	(void)i;
+	ch8_scroll_left(C8_PLANE_BOTH);
+}
+
+static void kernel_scroll_down_one(uint16_t i)
+{
+	ch8_scroll_down(C8_PLANE_LIGHT, 0x00C0 | (i & 0xF));
+}
+
+static void kernel_scroll_down(uint16_t i)
+{
+	ch8_scroll_down(C8_PLANE_BOTH, 0x00C0 | (i & 0xF));
+}
+
+static void kernel_scroll_up(uint16_t i)
+{
+	ch8_scroll_up(C8_PLANE_BOTH, 0x00D0 | (i & 0xF));
+}
+
+static void kernel_decompress(uint16_t i)
+{
+	(void)i;
+	ch8_decompress(kernel_unpacked, kernel_packed, kernel_packed_len);
+}
+
+// Kernels are passed the number of calls so far, to vary their inputs.
+struct bench_kernel {
+	const char *name;
+	void (*run)(uint16_t i);
+};
+
+// The draws leave the screen full of noise for the decompression kernel.
+static const struct bench_kernel KERNEL_BENCHES[] = {
+	{ "Draw 16x16 hi", kernel_draw_16_hi },
+	{ "Draw 8xn hi", kernel_draw_8_hi },
+	{ "Draw 16x16 lo", kernel_draw_16_lo },
+	{ "Draw 8xn lo", kernel_draw_8_lo },
+	{ "Scroll R 1 plane", kernel_scroll_right_one },
+	{ "Scroll R", kernel_scroll_right },
+	{ "Scroll L", kernel_scroll_left },
+	{ "Scroll D 1 plane", kernel_scroll_down_one },
+	{ "Scroll D", kernel_scroll_down },
+	{ "Scroll U", kernel_scroll_up },
+	{ "Decompress", kernel_decompress },
+};
+
+#define KERNEL_COUNT (sizeof(KERNEL_BENCHES) / sizeof(KERNEL_BENCHES[0]))
+
+static enum ch8_bench_mode bench_mode;
+static unsigned long bench_steps[BENCH_COUNT];
+static unsigned long bench_draws[BENCH_COUNT];
+// Mean time per call and largest distance of a run from it, in us.
+static unsigned long kernel_mean[KERNEL_COUNT];
+static unsigned long kernel_spread[KERNEL_COUNT];
+
+static unsigned long per_second(unsigned long count)
+{
+	return count * BENCH_HZ_X10 / (BENCH_TICKS * 10);
+}
+
+// Waits for the start of the next timer tick.
+static uint16_t next_tick(void)
+{
+	uint16_t start = ch8_ticks;
+
+	while (ch8_ticks == start)
+		;
+
+	return ch8_ticks;
+}
+
+/*
+ * Sets *us to the time per call of one run of the kernel. Returns FALSE if
+ * Esc was pressed.
+ */
+static _Bool time_kernel(const struct bench_kernel *kernel, unsigned long *us)
+{
+	unsigned long calls = 0;
+	uint16_t start = next_tick();
+
+	while ((uint16_t)(ch8_ticks - start) < KERNEL_TICKS) {
+		kernel->run(calls++);
+
+		if (_keytest(RR_ESC))
+			return FALSE;
+	}
+
+	*us = KERNEL_TICKS * 10000000UL / (BENCH_HZ_X10 * calls);
+	return TRUE;
+}
+
+/*
+ * Times each kernel in turn. The decompression kernel unpacks a copy of the
+ * screen as it was left by the kernels before it.
+ *
+ * Safety: can trigger heap compression.
+ */
+static enum ch8_error bench_kernels(void)
+{
+	unsigned long runs[KERNEL_REPEATS];
+	unsigned long total, spread;
+	enum ch8_error result = E_OK;
+	uint8_t screen[2048];
+	uint8_t i, j;
+
+	kernel_unpacked = malloc(sizeof(screen));
+	kernel_packed = malloc(2 * sizeof(screen));
+	if (!kernel_unpacked || !kernel_packed) {
+		result = E_OOM;
+		goto out;
+	}
+
+	ch8_clear_window(GrayGetPlane(LIGHT_PLANE));
+	ch8_clear_window(GrayGetPlane(DARK_PLANE));
+
+	for (i = 0; i < KERNEL_COUNT; i++) {
+		if (KERNEL_BENCHES[i].run == kernel_decompress) {
+			save_chip8_screen(screen);
+			kernel_packed_len = ch8_compress(kernel_packed, screen,
+							 sizeof(screen));
+		}
+
+		total = 0;
+		for (j = 0; j < KERNEL_REPEATS; j++) {
+			if (!time_kernel(&KERNEL_BENCHES[i], &runs[j])) {
+				result = E_SILENT_EXIT;
+				goto out;
+			}
+			total += runs[j];
+		}
+
+		kernel_mean[i] = total / KERNEL_REPEATS;
+		kernel_spread[i] = 0;
+		for (j = 0; j < KERNEL_REPEATS; j++) {
+			spread = runs[j] > kernel_mean[i] ?
+					 runs[j] - kernel_mean[i] :
+					 kernel_mean[i] - runs[j];
+			if (spread > kernel_spread[i])
+				kernel_spread[i] = spread;
+		}
+	}
+
+out:
+	free(kernel_unpacked);
+	free(kernel_packed);
+	kernel_unpacked = kernel_packed = NULL;
+	return result;
+}
+
+/*
+ * Runs every benchmark of the given kind in turn from the given state, which
+ * should be freshly loaded with nothing but the font. Must be called with the
+ * timer interrupt running, as from ch8_start().
+ *
+ * Safety: can trigger heap compression.
+ */
+enum ch8_error ch8_bench(struct ch8_state *state, enum ch8_bench_mode mode)
+{
+	const struct bench_rom *rom;
+	enum ch8_error result;
+	uint8_t i;
+
+	bench_mode = mode;
+	if (mode == BENCH_KERNELS)
+		return bench_kernels();
+
+	for (i = 0; i < BENCH_COUNT; i++) {
+		rom = &ROM_BENCHES[i];
+
+		state->stack = ch8_stack_new();
+		state->planes = C8_PLANE_BOTH;
+		state->pc = 0x200;
+		state->I = 0;
+		state->is_hires_on = FALSE;
+		memset(state->registers, 0, sizeof(state->registers));
+		memcpy(state->memory + 0x200, rom->code, rom->len);
+
+		ch8_clear_window(GrayGetPlane(LIGHT_PLANE));
+		ch8_clear_window(GrayGetPlane(DARK_PLANE));
+
+		result = ch8_run_ticks(state, BENCH_TICKS, &bench_steps[i],
+				       &bench_draws[i]);
+		if (result != E_OK)
+			return result;
+	}
+
+	return E_OK;
+}
+
+/*
+ * Shows the results of the last ch8_bench() run. Call once greyscale is off.
+ *
+ * Safety: can trigger heap compression.
+ */
+void ch8_bench_report(void)
+{
+	char msg[KERNEL_COUNT * 40];
+	char *p = msg;
+	uint8_t i;
+
+	if (bench_mode == BENCH_KERNELS) {
+		for (i = 0; i < KERNEL_COUNT; i++)
+			p += sprintf(p, "%s%s: %lu +-%lu us",
+				     i ? "\n" : "", KERNEL_BENCHES[i].name,
+				     kernel_mean[i], kernel_spread[i]);
+
+		DlgMessage("Kernels", msg, BT_NONE, BT_OK);
+		return;
+	}
+
+	for (i = 0; i < BENCH_COUNT; i++) {
+		p += sprintf(p, "%s: %lu ips", ROM_BENCHES[i].name,
+			     per_second(bench_steps[i]));
+
+		if (ROM_BENCHES[i].draws)
+			p += sprintf(p, ", %lu dps",
+				     per_second(bench_draws[i]));
+
+		if (i != BENCH_COUNT - 1)
+			*p++ = '\n';
+	}
+
+	DlgMessage("Benchmark", msg, BT_NONE, BT_OK);
+}
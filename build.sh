@@ -3,17 +3,17 @@ rm -rf output
 mkdir output/
 tigcc -std=gnu99 -mregparm -fno-zero-initialized-in-bss --omit-bss-init \
  --cut-ranges --reorder-sections --merge-constants -ffunction-sections \
- -fdata-sections --optimize-code -Os startup.c opcodes.c sprite.c -o \
+ -fdata-sections --optimize-code -Os startup.c opcodes.c sprite.c lzss.c replay.c bench.c trace.c -o \
  output/ch8ti -Wall -Wextra -DUSE_TI89 -DOPTIMIZE_ROM_CALLS  --native
 
 tigcc -std=gnu99 -mregparm -fno-zero-initialized-in-bss --omit-bss-init \
  --cut-ranges --reorder-sections --merge-constants -ffunction-sections \
- -fdata-sections --optimize-code -Os startup.c opcodes.c sprite.c -o \
+ -fdata-sections --optimize-code -Os startup.c opcodes.c sprite.c lzss.c replay.c bench.c trace.c -o \
  output/ch8ti -Wall -Wextra -DUSE_TI92P -DOPTIMIZE_ROM_CALLS  --native
 
 tigcc -std=gnu99 -mregparm -fno-zero-initialized-in-bss --omit-bss-init \
  --cut-ranges --reorder-sections --merge-constants -ffunction-sections \
- -fdata-sections --optimize-code -Os startup.c opcodes.c sprite.c -o \
+ -fdata-sections --optimize-code -Os startup.c opcodes.c sprite.c lzss.c replay.c bench.c trace.c -o \
  output/ch8ti -Wall -Wextra -DUSE_V200 -DOPTIMIZE_ROM_CALLS  --native
 
 cd preprocessor
@@ -25,6 +25,7 @@
 
 #include <graph.h>
 #include <stdint.h>
+#include <vat.h>
 
 // The major version number is used for rom and save file format compatibility.
 #define MAJOR_VERSION 1
@@ -48,6 +49,9 @@
 enum ch8_error {
 	E_OK,
 	E_EXIT_SAVE,
+	E_SWITCH_ROM,
+	E_CHECKPOINT,
+	E_REPLAY_VERIFIED,
 	E_SILENT_EXIT,
 	E_INVALID_ARGUMENT,
 	E_ROM_LOAD,
@@ -57,6 +61,7 @@ enum ch8_error {
 	E_OOM,
 	E_INVALID_OPCODE,
 	E_INVALID_ADDRESS,
+	E_REPLAY_DIVERGED,
 	E_UNKNOWN_ERR,
 };
 
@@ -110,14 +115,128 @@ struct ch8_rom {
 	uint8_t rom[];
 } __attribute__((packed));
 
+#ifdef CH8_TRACE
+/*
+ * Builds with -DCH8_TRACE count events on the hot paths and display the
+ * totals once the game exits, and capture the rom's control flow for offline
+ * analysis (see trace.c). Otherwise, tracepoints compile to nothing.
+ */
+enum ch8_trace_event {
+	TRACE_STEP,
+	TRACE_DRAW,
+	TRACE_COLLISION,
+	TRACE_DRAW_FLUSH,
+	TRACE_SCROLL,
+	TRACE_TIMER_TICK,
+	TRACE_KEY_READ,
+	TRACE_ERROR_EXIT,
+	TRACE_EVENTS,
+};
+
+extern unsigned long ch8_trace_counts[TRACE_EVENTS];
+
+#define ch8_trace(event) (ch8_trace_counts[event]++)
+
+// trace.c
+void ch8_trace_start(void);
+void ch8_trace_resume(void);
+void ch8_trace_pc(uint16_t pc);
+void ch8_trace_finish(const struct ch8_state *state);
+#else
+#define ch8_trace(event) ((void)0)
+#define ch8_trace_start() ((void)0)
+#define ch8_trace_resume() ((void)0)
+#define ch8_trace_pc(pc) ((void)0)
+#define ch8_trace_finish(state) ((void)0)
+#endif
+
+/*
+ * Builds with -DCH8_PROFILE note which part of the emulator is running on
+ * every timer interrupt, and display the share of samples that landed in each
+ * once the game exits. ch8_profile_enter() returns the phase it replaced, so
+ * that nested phases can restore it when they are done. Otherwise, it
+ * compiles to nothing.
+ */
+enum ch8_profile_phase {
+	PROFILE_IDLE, // Outside of ch8_run(), not reported.
+	PROFILE_INTERPRET,
+	PROFILE_DRAW,
+	PROFILE_PRESENT,
+	PROFILE_KEYS,
+	PROFILE_PHASES,
+};
+
+#ifdef CH8_PROFILE
+extern volatile uint8_t ch8_profile_phase;
+extern volatile unsigned long ch8_profile_samples[PROFILE_PHASES];
+#endif
+
+static inline uint8_t ch8_profile_enter(uint8_t phase)
+{
+#ifdef CH8_PROFILE
+	uint8_t prev = ch8_profile_phase;
+
+	ch8_profile_phase = phase;
+	return prev;
+#else
+	return phase;
+#endif
+}
+
 #define X_BASE ((LCD_WIDTH / 2 - 128 / 2) & 0xF0)
 #define Y_BASE ((LCD_HEIGHT / 2 - 64 / 2) & 0xF0)
 
+// startup.c
+extern volatile uint16_t ch8_ticks;
+void ch8_timer_tick(void);
+void ch8_quicksave(struct ch8_state *state);
+void ch8_store_var(SYM_STR name, HANDLE handle);
+
+// bench.c
+enum ch8_bench_mode {
+	BENCH_OFF,
+	BENCH_ROMS,
+	BENCH_KERNELS,
+};
+
+enum ch8_error ch8_bench(struct ch8_state *state, enum ch8_bench_mode mode);
+void ch8_bench_report(void);
+
+// lzss.c
+uint16_t ch8_decompress(uint8_t *restrict dest, const uint8_t *restrict src,
+			uint16_t srclen);
+uint16_t ch8_decompress_n(uint8_t *restrict dest, uint16_t destlen,
+			  const uint8_t *restrict src, uint16_t srclen);
+uint16_t ch8_compress(uint8_t *restrict dest, const uint8_t *restrict src,
+		      uint16_t srclen);
+
 // opcodes.c
+extern _Bool ch8_governor_on;
+extern uint16_t ch8_governor_limit;
 struct ch8_stack ch8_stack_new(void);
-enum ch8_error ch8_run(struct ch8_state *state);
+uint16_t ch8_read_keys(void);
+void ch8_memo_free(void);
+enum ch8_error ch8_run(struct ch8_state *state, uint16_t tick_period);
+enum ch8_error ch8_run_ticks(struct ch8_state *state, uint16_t ticks,
+			     unsigned long *steps, unsigned long *draws);
+
+// replay.c
+extern _Bool ch8_replay_on;
+extern uint16_t ch8_replay_keys;
+extern uint16_t ch8_replay_edges;
+extern uint16_t ch8_replay_diverged;
+_Bool ch8_is_replay(const MULTI_EXPR *data);
+enum ch8_error ch8_replay_record(const char *name, uint16_t tick_period);
+enum ch8_error ch8_replay_play(HSym sym, struct ch8_state *state,
+			       uint16_t seek, uint16_t *tick_period,
+			       _Bool verify);
+void ch8_replay_begin(struct ch8_state *state);
+void ch8_replay_frame(struct ch8_state *state);
+enum ch8_error ch8_replay_check(struct ch8_state *state);
+enum ch8_error ch8_replay_finish(void);
 
 // sprite.c
+extern _Bool ch8_clip_sprites;
 _Bool draw_sprite_16_hi(enum ch8_plane planes, const uint16_t *sprite16,
 			uint8_t x, uint8_t y, uint8_t n);
 _Bool draw_sprite_16_lo(enum ch8_plane planes, const uint16_t *sprite16,
@@ -132,6 +251,12 @@ void ch8_scroll_right(enum ch8_plane planes);
 void ch8_scroll_left(enum ch8_plane planes);
 void ch8_scroll_down(enum ch8_plane planes, uint16_t op);
 void ch8_scroll_up(enum ch8_plane planes, uint16_t op);
+void ch8_clear_window(void *lcd);
+void ch8_draw_list_new(void);
+void ch8_draw_list_free(void);
+void ch8_draw_list_flush(void);
+void ch8_draw_list_drop(enum ch8_plane planes);
+uint16_t ch8_frame_hash(void);
 void ch8_clear_background(void);
 void ch8_set_background(void);
 
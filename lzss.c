@@ -0,0 +1,175 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chip8.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The compressed format is shared with ch8ti-prep. Bytes other than 0xFF are
+ * literals. 0xFF is followed by a byte whose low 6 bits are a match length.
+ * A length of 0 encodes a literal 0xFF. Otherwise, the top 2 bits of that
+ * byte and all of the next one form a 10-bit offset. The match is copied from
+ * offset + 1 bytes back in the output.
+ */
+
+#define COMPRESS_FLAG 0xFF
+#define MAX_MATCH_LEN 63
+#define WINDOW_SIZE 1024
+#define HASH_SIZE 512
+
+/* 
+ * Provides a very simple LZSS decompressor for roms and savestates.
+ *
+ * Warning: will do funky things when the structure isn't as expected.
+ * Only use for trusted inputs. See ch8_decompress_n() for the rest.
+ */
+uint16_t ch8_decompress(uint8_t *restrict dest, const uint8_t *restrict src,
+			uint16_t srclen)
+{
+	uint16_t count = 0;
+	uint16_t offset;
+	uint16_t i = 0;
+
+	while (srclen > i) {
+		if (src[i] != 0xFF) {
+			dest[count++] = src[i++];
+		} else if (src[i + 1] & 63) {
+			for (uint8_t j = 0; j < (src[i + 1] & 63); j++) {
+				offset = (src[i + 1] & 0xC0) << 2 | src[i + 2];
+				dest[count + j] = dest[count + j - offset - 1];
+			}
+			count += src[i + 1] & 63;
+			i += 3;
+		} else {
+			dest[count++] = 0xFF;
+			i += 2;
+		}
+	}
+	return count;
+}
+
+/*
+ * A bounds-checked ch8_decompress() for inputs that may be corrupt, such as
+ * savestates and replays. Returns 0 if the input is truncated, refers back
+ * before the start of the output, or doesn't fit in destlen bytes.
+ */
+uint16_t ch8_decompress_n(uint8_t *restrict dest, uint16_t destlen,
+			  const uint8_t *restrict src, uint16_t srclen)
+{
+	uint16_t count = 0;
+	uint16_t offset;
+	uint16_t len;
+	uint16_t i = 0;
+
+	while (i < srclen) {
+		if (src[i] != COMPRESS_FLAG) {
+			if (count == destlen)
+				return 0;
+			dest[count++] = src[i++];
+			continue;
+		}
+
+		if (srclen - i < 2)
+			return 0;
+
+		if (!(len = src[i + 1] & 63)) {
+			if (count == destlen)
+				return 0;
+			dest[count++] = COMPRESS_FLAG;
+			i += 2;
+			continue;
+		}
+
+		if (srclen - i < 3)
+			return 0;
+
+		offset = (src[i + 1] & 0xC0) << 2 | src[i + 2];
+		if (offset >= count || len > destlen - count)
+			return 0;
+
+		for (uint8_t j = 0; j < len; j++)
+			dest[count + j] = dest[count + j - offset - 1];
+		count += len;
+		i += 3;
+	}
+
+	return count;
+}
+
+static inline uint16_t hash3(const uint8_t *p)
+{
+	return (p[0] << 5 ^ p[1] << 2 ^ p[2]) % HASH_SIZE;
+}
+
+/*
+ * A fast compressor for the format above, meant for compressing state on the
+ * calculator. It only tries the last position with the same 3-byte hash, so it
+ * doesn't compress as well as ch8ti-prep, but it is quick enough to run
+ * between frames.
+ *
+ * dest must have room for 2 * srclen bytes. Returns the compressed length.
+ */
+uint16_t ch8_compress(uint8_t *restrict dest, const uint8_t *restrict src,
+		      uint16_t srclen)
+{
+	uint16_t head[HASH_SIZE];
+	uint16_t count = 0;
+	uint16_t i = 0;
+	uint16_t cand;
+	uint16_t cost;
+	uint16_t len;
+	uint16_t h;
+
+	memset(head, 0xFF, sizeof(head));
+
+	while (i < srclen) {
+		len = 0;
+
+		if (i + 2 < srclen) {
+			h = hash3(src + i);
+			cand = head[h];
+			head[h] = i;
+
+			if (cand != UINT16_MAX && i - cand <= WINDOW_SIZE)
+				while (len < MAX_MATCH_LEN && i + len < srclen &&
+				       src[cand + len] == src[i + len])
+					len++;
+		}
+
+		// Only worth it if the literals would take more than 3 bytes.
+		cost = 0;
+		for (uint16_t j = 0; j < len && cost <= 3; j++)
+			cost += src[i + j] == COMPRESS_FLAG ? 2 : 1;
+
+		if (cost > 3) {
+			uint16_t offset = i - cand - 1;
+
+			dest[count++] = COMPRESS_FLAG;
+			dest[count++] = (offset & 0x300) >> 2 | len;
+			dest[count++] = offset & 0xFF;
+			i += len;
+		} else if (src[i] == COMPRESS_FLAG) {
+			dest[count++] = COMPRESS_FLAG;
+			dest[count++] = 0;
+			i++;
+		} else {
+			dest[count++] = src[i++];
+		}
+	}
+
+	return count;
+}
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <system.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -81,13 +82,18 @@ static uint16_t ch8_stack_pop(struct ch8_stack *stack)
  *  |1|2|3|+|
  *  |0|.|-|e|
  *
- * In addition, esc can be used to exit the program and F1 can be used to open
- * the savestate dialog. Also note that the up, down, left, and right arrow
- * keys are bound to the 5, 8, 7, and 9 CHIP8 keys, respectively. 
+ * In addition, esc can be used to exit the program, F1 can be used to open
+ * the savestate dialog, F2 can be used to switch to another rom and F3 takes
+ * a quick save. Also note that the up, down, left, and right arrow keys are
+ * bound to the 5, 8, 7, and 9 CHIP8 keys, respectively. 
  * 2nd (and HAND) can similarly be used for the CHIP8 6 key.
  */
-static void read_keyboard(char out[18])
+static void read_keyboard(char out[19])
 {
+	uint8_t phase = ch8_profile_enter(PROFILE_KEYS);
+
+	ch8_trace(TRACE_KEY_READ);
+
 	if (TI89 == TRUE) {
 		BEGIN_KEYTEST
 		out[0xC] = _keytest_optimized(RR_MULTIPLY);
@@ -122,6 +128,7 @@ static void read_keyboard(char out[18])
 		END_KEYTEST
 		out[0x10] = _keytest(RR_ESC);
 		out[0x11] = _keytest(RR_F1);
+		out[0x12] = _keytest(RR_F2);
 	} else {
 		// TI-92P or V200
 		BEGIN_KEYTEST
@@ -158,7 +165,41 @@ static void read_keyboard(char out[18])
 		out[0xE] = _keytest(RR_PLUS);
 		out[0x10] = _keytest(RR_ESC);
 		out[0x11] = _keytest(RR_F1);
+		out[0x12] = _keytest(RR_F2);
 	}
+
+	ch8_profile_enter(phase);
+}
+
+/*
+ * Returns the CHIP-8 keys that are held down, with key n in bit n.
+ */
+uint16_t ch8_read_keys(void)
+{
+	char board[19];
+	uint16_t keys = 0;
+
+	read_keyboard(board);
+
+	for (int8_t i = 15; i >= 0; i--)
+		keys = keys << 1 | (board[i] != 0);
+
+	return keys;
+}
+
+/*
+ * Replays need every key read in a frame to agree, so while one is running,
+ * keys come from the mask sampled at the start of the frame.
+ */
+static _Bool is_key_down(uint8_t key)
+{
+	char board[19];
+
+	if (ch8_replay_on)
+		return ch8_replay_keys >> key & 1;
+
+	read_keyboard(board);
+	return board[key];
 }
 
 // These don't need explaining.
@@ -183,6 +224,514 @@ static inline uint8_t last(uint16_t x)
 	return x & 0xF;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Subroutine memoization
+//
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Many roms call small helper routines that only compute new register values
+ * from old ones (and from memory that never changes). The first call to each
+ * 2nnn target is analysed, and if the routine is pure, the registers it reads
+ * and the ones it writes are recorded. Later calls with the same inputs then
+ * replay the recorded outputs instead of executing the routine.
+ */
+
+#define MEMO_ROUTINES 16
+#define MEMO_RESULTS 4
+#define MEMO_MAX_LEN 32
+
+// Replayed routines would be missing from the trace. See trace.c.
+#ifdef CH8_TRACE
+#define MEMO_ENABLED FALSE
+#else
+#define MEMO_ENABLED TRUE
+#endif
+
+// Effect masks use bits 0-15 for V0-VF and bit 16 for I.
+#define MEMO_VF (1UL << 0xF)
+#define MEMO_I (1UL << 16)
+
+struct memo_result {
+	uint8_t in[16];
+	uint8_t out[16];
+	uint16_t in_I;
+	uint16_t out_I;
+	// Inclusive range of memory read by the routine. Empty when lo > hi.
+	uint16_t mem_lo;
+	uint16_t mem_hi;
+	_Bool valid;
+};
+
+struct memo_routine {
+	uint16_t addr; // 0 when the slot is unused.
+	uint16_t end; // Last byte of the terminating 00EE.
+	uint8_t code[2 * MEMO_MAX_LEN]; // The bytes from addr to end.
+	_Bool is_pure;
+	uint8_t next; // Result slot to replace next.
+	uint32_t in_mask;
+	uint32_t out_mask;
+	struct memo_result results[MEMO_RESULTS];
+};
+
+/*
+ * Set by ch8_run(). Memoization is disabled when this is NULL, which is also
+ * the case when there wasn't enough memory for the table.
+ */
+static struct memo_routine *memo_table;
+
+/*
+ * The table outlives each ch8_run() call, so that switching back to a rom
+ * with F2, or to a savestate of it, doesn't analyse its routines all over
+ * again. Entries left behind by another rom, or by code that has changed
+ * since, are caught by comparing their code in memo_begin(). Freed by
+ * ch8_memo_free().
+ */
+static struct memo_routine *memo_cache;
+
+static void ch8_step(struct ch8_state *state);
+
+// Mask of registers Vx to Vy, inclusive. Empty if x > y.
+static inline uint32_t memo_reg_range(uint8_t x, uint8_t y)
+{
+	return ((2UL << y) - 1) & ~((1UL << x) - 1);
+}
+
+/*
+ * Fills in the registers read and written by an opcode. Returns FALSE for
+ * anything that has effects outside of V0-VF and I, such as drawing, timers,
+ * keys, rand, memory stores and control flow.
+ */
+static _Bool memo_effects(uint16_t op, uint32_t *reads, uint32_t *writes,
+			  _Bool *skips)
+{
+	uint32_t vx = 1UL << second(op);
+	uint32_t vy = 1UL << third(op);
+
+	*reads = 0;
+	*writes = 0;
+	*skips = FALSE;
+
+	switch (first(op)) {
+	case 0x3:
+	case 0x4:
+		*reads = vx;
+		*skips = TRUE;
+		return TRUE;
+	case 0x5:
+		if (last(op) == 0x3) {
+			*reads = MEMO_I;
+			*writes = memo_reg_range(second(op), third(op));
+			return TRUE;
+		}
+		/* fallthrough */
+	case 0x9:
+		if (last(op) != 0x0)
+			return FALSE;
+		*reads = vx | vy;
+		*skips = TRUE;
+		return TRUE;
+	case 0x6:
+		*writes = vx;
+		return TRUE;
+	case 0x7:
+		*reads = vx;
+		*writes = vx;
+		return TRUE;
+	case 0x8:
+		switch (last(op)) {
+		case 0x0:
+			*reads = vy;
+			*writes = vx;
+			return TRUE;
+		case 0x1:
+		case 0x2:
+		case 0x3:
+			*reads = vx | vy;
+			*writes = vx;
+			return TRUE;
+		case 0x4:
+		case 0x5:
+		case 0x7:
+			*reads = vx | vy;
+			*writes = vx | MEMO_VF;
+			return TRUE;
+		case 0x6:
+		case 0xE:
+			*reads = vy;
+			*writes = vx | MEMO_VF;
+			return TRUE;
+		}
+		return FALSE;
+	case 0xA:
+		*writes = MEMO_I;
+		return TRUE;
+	case 0xF:
+		switch (op & 0xFF) {
+		case 0x1E:
+			*reads = vx | MEMO_I;
+			*writes = MEMO_I | MEMO_VF;
+			return TRUE;
+		case 0x29:
+		case 0x30:
+			*reads = vx;
+			*writes = MEMO_I;
+			return TRUE;
+		case 0x65:
+			*reads = MEMO_I;
+			*writes = memo_reg_range(0, second(op)) | MEMO_I;
+			return TRUE;
+		}
+		return FALSE;
+	}
+	return FALSE;
+}
+
+/*
+ * Scans the routine at addr for a run of pure opcodes ending in 00EE.
+ *
+ * Skips can only jump over a single instruction, so every instruction runs
+ * unless the one before it is a skip. A register is an input if it is read,
+ * or only conditionally written, before an instruction that always runs
+ * writes it.
+ */
+static void memo_analyze(const struct ch8_state *state,
+			 struct memo_routine *r, uint16_t addr)
+{
+	uint32_t defined = 0;
+	_Bool after_skip = FALSE;
+	uint32_t reads, writes;
+	_Bool skips;
+	uint16_t op;
+
+	r->addr = addr;
+	r->is_pure = FALSE;
+	r->next = 0;
+	r->in_mask = 0;
+	r->out_mask = 0;
+	for (short i = 0; i < MEMO_RESULTS; i++)
+		r->results[i].valid = FALSE;
+
+	for (uint16_t pc = addr; pc < addr + 2 * MEMO_MAX_LEN && pc <= 0xFFE;
+	     pc += 2) {
+		op = state->memory[pc] << 8 | state->memory[pc + 1];
+
+		if (op == 0x00EE) {
+			// A skipped 00EE would fall through into unknown code.
+			if (after_skip)
+				return;
+
+			r->end = pc + 1;
+			memcpy(r->code, state->memory + addr, r->end - addr + 1);
+			r->is_pure = TRUE;
+			return;
+		}
+
+		if (!memo_effects(op, &reads, &writes, &skips))
+			return;
+
+		r->in_mask |= reads & ~defined;
+		if (after_skip)
+			r->in_mask |= writes & ~defined;
+		else
+			defined |= writes;
+		r->out_mask |= writes;
+
+		after_skip = skips;
+	}
+}
+
+/*
+ * Widens [*lo, *hi] to cover the memory that op is about to read. Wrapping
+ * reads are treated as reading all of memory.
+ */
+static void memo_note_read(const struct ch8_state *state, uint16_t op,
+			   uint16_t *lo, uint16_t *hi)
+{
+	uint16_t start, end;
+
+	if (first(op) == 0x5 && last(op) == 0x3) {
+		if (second(op) > third(op))
+			return;
+		start = state->I + second(op);
+		end = state->I + third(op);
+	} else if (first(op) == 0xF && (op & 0xFF) == 0x65) {
+		start = state->I;
+		end = state->I + second(op);
+	} else {
+		return;
+	}
+
+	if (end > 0xFFF) {
+		start = 0;
+		end = 0xFFF;
+	}
+
+	if (start < *lo)
+		*lo = start;
+	if (end > *hi)
+		*hi = end;
+}
+
+static _Bool memo_matches(const struct memo_routine *r,
+			  const struct memo_result *res,
+			  const struct ch8_state *state)
+{
+	if (!res->valid)
+		return FALSE;
+
+	if ((r->in_mask & MEMO_I) && res->in_I != state->I)
+		return FALSE;
+
+	for (short i = 0; i < 16; i++)
+		if ((r->in_mask >> i & 1) && res->in[i] != state->registers[i])
+			return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Called by 2nnn after the return address has been pushed and pc set to the
+ * routine. Either replays a recorded result and returns, or runs the routine
+ * to completion while recording its result. Does nothing for impure routines.
+ */
+static void memo_call(struct ch8_state *state)
+{
+	struct memo_routine *r;
+	struct memo_result *res;
+	uint8_t sp = state->stack.sp;
+	uint16_t op;
+
+	r = &memo_table[(state->pc >> 1) % MEMO_ROUTINES];
+	if (r->addr != state->pc)
+		memo_analyze(state, r, state->pc);
+
+	if (!r->is_pure)
+		return;
+
+	for (short i = 0; i < MEMO_RESULTS; i++) {
+		res = &r->results[i];
+		if (!memo_matches(r, res, state))
+			continue;
+
+		for (short j = 0; j < 16; j++)
+			if (r->out_mask >> j & 1)
+				state->registers[j] = res->out[j];
+		if (r->out_mask & MEMO_I)
+			state->I = res->out_I;
+
+		state->pc = ch8_stack_pop(&state->stack);
+		return;
+	}
+
+	res = &r->results[r->next];
+	r->next = (r->next + 1) % MEMO_RESULTS;
+
+	memcpy(res->in, state->registers, sizeof(res->in));
+	res->in_I = state->I;
+	res->mem_lo = UINT16_MAX;
+	res->mem_hi = 0;
+
+	// The routine is straight-line code, so it always reaches its 00EE.
+	while (state->stack.sp == sp) {
+		op = state->memory[state->pc] << 8 |
+		     state->memory[state->pc + 1];
+		memo_note_read(state, op, &res->mem_lo, &res->mem_hi);
+		ch8_step(state);
+	}
+
+	memcpy(res->out, state->registers, sizeof(res->out));
+	res->out_I = state->I;
+	res->valid = TRUE;
+}
+
+/*
+ * Forgets everything that depends on memory in [addr, addr + len). Must be
+ * called by every opcode that writes to memory.
+ */
+static void memo_invalidate(uint16_t addr, uint16_t len)
+{
+	struct memo_routine *r;
+	struct memo_result *res;
+	uint16_t lo = addr;
+	uint16_t hi = addr + len - 1;
+
+	if (!memo_table)
+		return;
+
+	if (hi > 0xFFF) {
+		lo = 0;
+		hi = 0xFFF;
+	}
+
+	for (short i = 0; i < MEMO_ROUTINES; i++) {
+		r = &memo_table[i];
+		if (!r->is_pure)
+			continue;
+
+		// Self-modifying code needs to be analysed again.
+		if (lo <= r->end && hi >= r->addr) {
+			r->addr = 0;
+			r->is_pure = FALSE;
+			continue;
+		}
+
+		for (short j = 0; j < MEMO_RESULTS; j++) {
+			res = &r->results[j];
+			if (lo <= res->mem_hi && hi >= res->mem_lo)
+				res->valid = FALSE;
+		}
+	}
+}
+
+/*
+ * Enables memoization for a run from the given state, reusing what is left
+ * of the table from earlier runs. Routines whose code no longer matches are
+ * forgotten, as are results that read memory, which may have changed since.
+ */
+static void memo_begin(const struct ch8_state *state)
+{
+	struct memo_routine *r;
+
+	if (!memo_cache) {
+		memo_table = memo_cache =
+			calloc(MEMO_ROUTINES, sizeof(*memo_cache));
+		return;
+	}
+
+	for (short i = 0; i < MEMO_ROUTINES; i++) {
+		r = &memo_cache[i];
+		if (!r->is_pure || memcmp(r->code, state->memory + r->addr,
+					  r->end - r->addr + 1)) {
+			r->addr = 0;
+			r->is_pure = FALSE;
+			continue;
+		}
+
+		for (short j = 0; j < MEMO_RESULTS; j++)
+			if (r->results[j].mem_lo <= r->results[j].mem_hi)
+				r->results[j].valid = FALSE;
+	}
+
+	memo_table = memo_cache;
+}
+
+// Frees the memoization table kept between runs.
+void ch8_memo_free(void)
+{
+	free(memo_cache);
+	memo_cache = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Speed governor
+//
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Real-time runs normally execute as many instructions as the calculator can.
+ * With the governor on, ch8_run() stops after ch8_governor_limit instructions
+ * in a frame and sleeps until the next timer tick. Every GOVERNOR_WINDOW
+ * frames, the limit is adjusted from what the rom did:
+ *
+ *  - Roms that pace themselves poll Fx07 until the delay timer runs out.
+ *    Everything after the first poll of a frame is wasted, so the limit
+ *    moves to the most instructions a frame ran before polling, plus a
+ *    margin.
+ *  - Roms that clear the screen more than once a frame draw faster than the
+ *    screen can show, so the limit shrinks.
+ *  - Roms that keep running into the limit without doing either are starved,
+ *    so it grows.
+ *
+ * A limit of 0 runs the first window flat out, to measure the rom. The limit
+ * is shown on exit, so that it can be passed back in next time.
+ */
+#define GOVERNOR_MIN 8
+#define GOVERNOR_MAX 2000
+#define GOVERNOR_WINDOW 30
+
+_Bool ch8_governor_on = FALSE;
+uint16_t ch8_governor_limit = 0;
+
+static uint16_t frame_steps;
+static uint16_t frame_useful; // Instructions before the first Fx07 poll.
+static uint8_t frame_polls;
+static uint8_t frame_clears;
+
+static uint8_t window_frames;
+static uint8_t window_waits;
+static uint8_t window_capped;
+static uint16_t window_clears;
+static uint16_t window_useful;
+static uint16_t window_steps;
+
+// Called for Fx07. Only reads of a running timer count as polling it.
+static inline void governor_note_poll(const struct ch8_state *state)
+{
+	if (!ch8_governor_on || !state->delay_timer)
+		return;
+
+	if (!frame_polls++)
+		frame_useful = frame_steps;
+}
+
+// Called for 00E0.
+static inline void governor_note_clear(void)
+{
+	if (ch8_governor_on)
+		frame_clears++;
+}
+
+static void governor_reset(void)
+{
+	frame_steps = frame_polls = frame_clears = 0;
+	window_frames = window_waits = window_capped = 0;
+	window_clears = window_useful = window_steps = 0;
+}
+
+// Called at the start of every frame, to account for the one that ended.
+static void governor_frame(void)
+{
+	uint16_t limit = ch8_governor_limit;
+
+	// A single poll could just be reading the timer.
+	if (frame_polls >= 2) {
+		window_waits++;
+		if (frame_useful > window_useful)
+			window_useful = frame_useful;
+	}
+	if (limit && frame_steps >= limit)
+		window_capped++;
+	if (frame_steps > window_steps)
+		window_steps = frame_steps;
+	window_clears += frame_clears;
+
+	frame_steps = frame_polls = frame_clears = 0;
+
+	if (++window_frames < GOVERNOR_WINDOW)
+		return;
+
+	if (!limit)
+		limit = window_steps;
+
+	if (window_waits > GOVERNOR_WINDOW / 2)
+		limit = window_useful + window_useful / 4;
+	else if (window_clears > GOVERNOR_WINDOW)
+		limit -= limit / 4;
+	else if (window_capped > GOVERNOR_WINDOW / 2)
+		limit += limit / 4;
+
+	if (limit < GOVERNOR_MIN)
+		limit = GOVERNOR_MIN;
+	if (limit > GOVERNOR_MAX)
+		limit = GOVERNOR_MAX;
+
+	ch8_governor_limit = limit;
+	governor_reset();
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CHIP-8 opcode implementations
@@ -192,12 +741,16 @@ static inline uint8_t last(uint16_t x)
 #define OPCODE_HANDLER(x) static void x(struct ch8_state *state, uint16_t op)
 
 // 00E0 - Clear screen
+// Wrapper around ch8_clear_window()
 static void ch8_clear(enum ch8_plane planes)
 {
+	governor_note_clear();
+	ch8_draw_list_drop(planes);
+
 	if (planes & C8_PLANE_LIGHT)
-		memset(GrayGetPlane(LIGHT_PLANE), 0, LCD_SIZE);
+		ch8_clear_window(GrayGetPlane(LIGHT_PLANE));
 	if (planes & C8_PLANE_DARK)
-		memset(GrayGetPlane(DARK_PLANE), 0, LCD_SIZE);
+		ch8_clear_window(GrayGetPlane(DARK_PLANE));
 }
 
 // 00EE - Return from subroutine
@@ -235,6 +788,9 @@ OPCODE_HANDLER(ch8_call)
 {
 	ch8_stack_push(&state->stack, state->pc);
 	state->pc = op & 0xFFF;
+
+	if (memo_table)
+		memo_call(state);
 }
 
 // 3xnn - Skip the next instruction if Vx = nn
@@ -264,6 +820,10 @@ OPCODE_HANDLER(ch8_skip_reg_eq)
 // 5xy2 - Store Vx to Vy at I to I+(y-x). Do not update I (xo-chip)
 OPCODE_HANDLER(ch8_store_xo)
 {
+	if (second(op) <= third(op))
+		memo_invalidate(state->I + second(op),
+				third(op) - second(op) + 1);
+
 	for (short i = second(op); i <= third(op); i++)
 		state->memory[(state->I + i) & 0xFFF] = state->registers[i];
 }
@@ -387,12 +947,20 @@ OPCODE_HANDLER(ch8_rand)
 	state->registers[second(op)] = rand() & op & 0xFF;
 }
 
+// Instructions and draws executed by the last run_loop().
+static unsigned long run_steps;
+static unsigned long run_draws;
+
 // dxyn - Draw sprite
 OPCODE_HANDLER(ch8_draw)
 {
 	_Bool result;
 	uint8_t x = state->registers[second(op)];
 	uint8_t y = state->registers[third(op)];
+	uint8_t phase = ch8_profile_enter(PROFILE_DRAW);
+
+	ch8_trace(TRACE_DRAW);
+	++run_draws;
 
 	if (state->is_hires_on) {
 		if (!last(op))
@@ -414,7 +982,11 @@ OPCODE_HANDLER(ch8_draw)
 						  y, last(op));
 	}
 
+	if (result)
+		ch8_trace(TRACE_COLLISION);
+
 	state->registers[0xF] = result;
+	ch8_profile_enter(phase);
 }
 
 /*
@@ -424,15 +996,12 @@ OPCODE_HANDLER(ch8_draw)
  */
 OPCODE_HANDLER(ch8_key_set)
 {
-	char board[18];
 	uint8_t key = state->registers[second(op)];
 
 	if (key >= 16)
 		return;
 
-	read_keyboard(board);
-
-	if (board[key])
+	if (is_key_down(key))
 		state->pc += 2;
 }
 
@@ -442,12 +1011,9 @@ OPCODE_HANDLER(ch8_key_set)
  */
 OPCODE_HANDLER(ch8_key_unset)
 {
-	char board[18];
 	uint8_t key = state->registers[second(op)];
 
-	read_keyboard(board);
-
-	if ((key < 16 && !board[key]) || key >= 16)
+	if (key >= 16 || !is_key_down(key))
 		state->pc += 2;
 }
 
@@ -464,34 +1030,164 @@ OPCODE_HANDLER(ch8_set_draw_target)
 // fx07 - Set Vx = delay timer
 OPCODE_HANDLER(ch8_read_timer)
 {
+	governor_note_poll(state);
 	state->registers[second(op)] = state->delay_timer;
 }
 
+/*
+ * Fx0A returns the key that is released, which is nearly always a key that is
+ * already held down while the rom waits. So the wait is used to run ahead as
+ * if that key had been released, for as long as the instructions only touch
+ * V0-VF, I, the stack and the program counter. If the guess turns out right,
+ * the rom picks up where the speculation left off. Otherwise those few fields
+ * are rolled back, which is all that the speculation could have changed.
+ */
+#define SPEC_MAX_STEPS 512
+#define SPEC_CHUNK 16
+
+struct spec_snapshot {
+	struct ch8_stack stack;
+	uint16_t pc;
+	uint16_t I;
+	uint8_t registers[16];
+};
+
+static void spec_save(const struct ch8_state *state, struct spec_snapshot *s)
+{
+	s->stack = state->stack;
+	s->pc = state->pc;
+	s->I = state->I;
+	memcpy(s->registers, state->registers, sizeof(s->registers));
+}
+
+static void spec_restore(struct ch8_state *state,
+			 const struct spec_snapshot *s)
+{
+	state->stack = s->stack;
+	state->pc = s->pc;
+	state->I = s->I;
+	memcpy(state->registers, s->registers, sizeof(s->registers));
+}
+
+/*
+ * Whether the next instruction can be run without effects beyond a snapshot.
+ * Instructions that would throw are left for the real key to reach, since a
+ * wrong guess must not end a game that would have carried on.
+ */
+static _Bool spec_can_step(const struct ch8_state *state)
+{
+	uint32_t reads, writes;
+	_Bool skips;
+	uint16_t op;
+
+#ifdef CH8_TRACE
+	// Rolled back steps would be counted in the trace. See trace.c.
+	return FALSE;
+#endif
+
+	if (state->pc > 0x0FFE)
+		return FALSE;
+
+	op = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
+
+	switch (first(op)) {
+	case 0x0:
+		return op == 0x00EE && state->stack.sp > 0;
+	case 0x1:
+	case 0xB:
+		return TRUE;
+	case 0x2:
+		return state->stack.sp < C8_STACK_CAPACITY;
+	case 0xF:
+		// Fx29 and Fx30 reject digits above 0xF.
+		if (((op & 0xFF) == 0x29 || (op & 0xFF) == 0x30) &&
+		    state->registers[second(op)] > 0xF)
+			return FALSE;
+		break;
+	}
+
+	return memo_effects(op, &reads, &writes, &skips);
+}
+
 // fx0a - Set Vx = next pressed key (blocking)
 OPCODE_HANDLER(ch8_key_wait)
 {
-	char old_row[18];
-	char new_row[18];
+	struct spec_snapshot saved;
+	uint16_t spec_steps = 0;
+	int8_t guess = -1;
+	char old_row[19];
+	char new_row[19];
+
+	// Nothing else will show queued draws while waiting.
+	ch8_draw_list_flush();
+
+	/*
+	 * Waiting has to take virtual time in a replay, so the instruction is
+	 * repeated until a key is released between two frames.
+	 */
+	if (ch8_replay_on) {
+		for (uint8_t i = 0; i < 16; i++) {
+			if (ch8_replay_edges >> i & 1) {
+				ch8_replay_edges &= ~(1 << i);
+				state->registers[second(op)] = i;
+				return;
+			}
+		}
+
+		state->pc -= 2;
+		return;
+	}
 
 	read_keyboard(old_row);
 
 	while (1) {
 		read_keyboard(new_row);
 
+		// Anything that leaves the wait must not see speculated state.
+		if ((new_row[16] || new_row[17] || new_row[18]) && guess >= 0)
+			spec_restore(state, &saved);
+
 		// TODO handle other keys.
 		if (new_row[16])
 			ER_throw(E_SILENT_EXIT);
 		if (new_row[17])
 			ER_throw(E_EXIT_SAVE);
+		if (new_row[18])
+			ER_throw(E_SWITCH_ROM);
 
 		for (uint8_t i = 0; i < 16; i++) {
 			// Only evaluates to true on falling edge.
 			if (old_row[i] && !new_row[i]) {
+				if (i == guess)
+					return;
+				if (guess >= 0)
+					spec_restore(state, &saved);
+
 				state->registers[second(op)] = i;
 				return;
 			}
 		}
 
+		if (guess < 0) {
+			for (uint8_t i = 0; i < 16; i++) {
+				if (new_row[i]) {
+					spec_save(state, &saved);
+					state->registers[second(op)] = i;
+					guess = i;
+					break;
+				}
+			}
+		} else {
+			for (short i = 0; i < SPEC_CHUNK &&
+				    spec_steps < SPEC_MAX_STEPS &&
+				    spec_can_step(state); i++, spec_steps++)
+				ch8_step(state);
+
+			// Stops checking once there is nothing left to run.
+			if (!spec_can_step(state))
+				spec_steps = SPEC_MAX_STEPS;
+		}
+
 		memcpy(old_row, new_row, sizeof(new_row));
 	}
 }
@@ -539,6 +1235,8 @@ OPCODE_HANDLER(ch8_bcd)
 {
 	uint8_t num = state->registers[second(op)];
 
+	memo_invalidate(state->I, 3);
+
 	for (short j = 2; j >= 0; j--) {
 		state->memory[(state->I + j) & 0xFFF] = num % 10;
 		num /= 10;
@@ -548,6 +1246,8 @@ OPCODE_HANDLER(ch8_bcd)
 // fx55 - Store V0 to Vx at I to I+x. Set I += x + 1
 OPCODE_HANDLER(ch8_store)
 {
+	memo_invalidate(state->I, second(op) + 1);
+
 	for (short j = 0; j <= second(op); j++)
 		state->memory[(state->I + j) & 0xFFF] = state->registers[j];
 
@@ -582,6 +1282,153 @@ OPCODE_HANDLER(ch8_rpl_load)
 
 #undef OPCODE_HANDLER
 
+#ifdef CH8_FLAT_DECODE
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Flat opcode decode table
+//
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Building with -DCH8_FLAT_DECODE replaces the nested dispatch switches with a
+ * single table lookup. Every opcode is decoded by its first nibble and its low
+ * byte, which is enough to tell all opcodes apart, so the table has 4096
+ * one-byte entries. Anything not listed decodes to OP_INVALID.
+ *
+ * A full 64K-entry table would not fit in calculator RAM, and the operands are
+ * cheap enough to extract in the handlers.
+ */
+enum ch8_op {
+	OP_INVALID = 0,
+	OP_SCROLL_DOWN,
+	OP_SCROLL_UP,
+	OP_CLEAR,
+	OP_RET,
+	OP_SCROLL_RIGHT,
+	OP_SCROLL_LEFT,
+	OP_QUIT,
+	OP_EXIT_HIRES,
+	OP_ENTER_HIRES,
+	OP_JUMP,
+	OP_CALL,
+	OP_SKIP_EQ,
+	OP_SKIP_NEQ,
+	OP_SKIP_REG_EQ,
+	OP_STORE_XO,
+	OP_LOAD_XO,
+	OP_SET_IMM,
+	OP_ADD_IMM,
+	OP_MOV,
+	OP_OR,
+	OP_AND,
+	OP_XOR,
+	OP_ADD,
+	OP_SUB_5,
+	OP_LSR,
+	OP_SUB_7,
+	OP_LSL,
+	OP_SKIP_REG_NEQ,
+	OP_LOAD_PTR,
+	OP_JUMP_REG,
+	OP_RAND,
+	OP_DRAW,
+	OP_KEY_SET,
+	OP_KEY_UNSET,
+	OP_SET_DRAW_TARGET,
+	OP_BUZZER,
+	OP_READ_TIMER,
+	OP_KEY_WAIT,
+	OP_SET_TIMER,
+	OP_SET_SOUND,
+	OP_ADD_PTR,
+	OP_FONT,
+	OP_FONT_BIG,
+	OP_BCD,
+	OP_PITCH,
+	OP_STORE,
+	OP_LOAD,
+	OP_RPL_STORE,
+	OP_RPL_LOAD,
+};
+
+// Table index of an opcode.
+static inline uint16_t decode_index(uint16_t op)
+{
+	return (op & 0xF000) >> 4 | (op & 0xFF);
+}
+
+// Every entry in group g whose low nibble is n.
+#define EACH_Y(g, n, h)                                                        \
+	[g << 8 | 0x00 | n] = h, [g << 8 | 0x10 | n] = h,                      \
+	[g << 8 | 0x20 | n] = h, [g << 8 | 0x30 | n] = h,                      \
+	[g << 8 | 0x40 | n] = h, [g << 8 | 0x50 | n] = h,                      \
+	[g << 8 | 0x60 | n] = h, [g << 8 | 0x70 | n] = h,                      \
+	[g << 8 | 0x80 | n] = h, [g << 8 | 0x90 | n] = h,                      \
+	[g << 8 | 0xA0 | n] = h, [g << 8 | 0xB0 | n] = h,                      \
+	[g << 8 | 0xC0 | n] = h, [g << 8 | 0xD0 | n] = h,                      \
+	[g << 8 | 0xE0 | n] = h, [g << 8 | 0xF0 | n] = h
+
+// Every entry in group g.
+#define EACH(g, h) [g << 8 ... g << 8 | 0xFF] = h
+
+static const uint8_t CH8_DECODE[4096] = {
+	[0x0C0 ... 0x0CF] = OP_SCROLL_DOWN,
+	[0x0D0 ... 0x0DF] = OP_SCROLL_UP,
+	[0x0E0] = OP_CLEAR,
+	[0x0EE] = OP_RET,
+	[0x0FB] = OP_SCROLL_RIGHT,
+	[0x0FC] = OP_SCROLL_LEFT,
+	[0x0FD] = OP_QUIT,
+	[0x0FE] = OP_EXIT_HIRES,
+	[0x0FF] = OP_ENTER_HIRES,
+	EACH(0x1, OP_JUMP),
+	EACH(0x2, OP_CALL),
+	EACH(0x3, OP_SKIP_EQ),
+	EACH(0x4, OP_SKIP_NEQ),
+	EACH_Y(0x5, 0x0, OP_SKIP_REG_EQ),
+	EACH_Y(0x5, 0x2, OP_STORE_XO),
+	EACH_Y(0x5, 0x3, OP_LOAD_XO),
+	EACH(0x6, OP_SET_IMM),
+	EACH(0x7, OP_ADD_IMM),
+	EACH_Y(0x8, 0x0, OP_MOV),
+	EACH_Y(0x8, 0x1, OP_OR),
+	EACH_Y(0x8, 0x2, OP_AND),
+	EACH_Y(0x8, 0x3, OP_XOR),
+	EACH_Y(0x8, 0x4, OP_ADD),
+	EACH_Y(0x8, 0x5, OP_SUB_5),
+	EACH_Y(0x8, 0x6, OP_LSR),
+	EACH_Y(0x8, 0x7, OP_SUB_7),
+	EACH_Y(0x8, 0xE, OP_LSL),
+	EACH_Y(0x9, 0x0, OP_SKIP_REG_NEQ),
+	EACH(0xA, OP_LOAD_PTR),
+	EACH(0xB, OP_JUMP_REG),
+	EACH(0xC, OP_RAND),
+	EACH(0xD, OP_DRAW),
+	[0xE9E] = OP_KEY_SET,
+	[0xEA1] = OP_KEY_UNSET,
+	[0xF01] = OP_SET_DRAW_TARGET,
+	[0xF02] = OP_BUZZER,
+	[0xF07] = OP_READ_TIMER,
+	[0xF0A] = OP_KEY_WAIT,
+	[0xF15] = OP_SET_TIMER,
+	[0xF18] = OP_SET_SOUND,
+	[0xF1E] = OP_ADD_PTR,
+	[0xF29] = OP_FONT,
+	[0xF30] = OP_FONT_BIG,
+	[0xF33] = OP_BCD,
+	[0xF3A] = OP_PITCH,
+	[0xF55] = OP_STORE,
+	[0xF65] = OP_LOAD,
+	[0xF75] = OP_RPL_STORE,
+	[0xF85] = OP_RPL_LOAD,
+};
+
+#undef EACH
+#undef EACH_Y
+
+#else /* !CH8_FLAT_DECODE */
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CHIP-8 level 2 dispatch
@@ -788,12 +1635,185 @@ static void ch8_dispatch_f(struct ch8_state *state, uint16_t op)
 	}
 }
 
+#endif /* CH8_FLAT_DECODE */
+
 //////////////////////////////////////////////////////////////////////////////
 //
 //  Main execution loop and instruction dispatch
 //
 //////////////////////////////////////////////////////////////////////////////
 
+#ifdef CH8_FLAT_DECODE
+
+/*
+ * Performs dispatching of opcodes to their corresponding handlers through the
+ * flat decode table. Function pointers are *not* used because they block
+ * inlining by the compiler.
+ */
+static void ch8_dispatch(struct ch8_state *state, uint16_t opcode)
+{
+	// The table can't see the second nibble of 0nnn opcodes.
+	if ((opcode & 0xF000) == 0 && (opcode & 0x0F00) != 0)
+		ER_throw(E_INVALID_OPCODE);
+
+	switch (CH8_DECODE[decode_index(opcode)]) {
+	case OP_SCROLL_DOWN:
+		ch8_scroll_down(state->planes, opcode);
+		break;
+	case OP_SCROLL_UP:
+		ch8_scroll_up(state->planes, opcode);
+		break;
+	case OP_CLEAR:
+		ch8_clear(state->planes);
+		break;
+	case OP_RET:
+		ch8_ret(state);
+		break;
+	case OP_SCROLL_RIGHT:
+		ch8_scroll_right(state->planes);
+		break;
+	case OP_SCROLL_LEFT:
+		ch8_scroll_left(state->planes);
+		break;
+	case OP_QUIT:
+		ch8_quit();
+		break;
+	case OP_EXIT_HIRES:
+		ch8_exit_hires(state);
+		break;
+	case OP_ENTER_HIRES:
+		ch8_enter_hires(state);
+		break;
+	case OP_JUMP:
+		ch8_jump(state, opcode);
+		break;
+	case OP_CALL:
+		ch8_call(state, opcode);
+		break;
+	case OP_SKIP_EQ:
+		ch8_skip_eq(state, opcode);
+		break;
+	case OP_SKIP_NEQ:
+		ch8_skip_neq(state, opcode);
+		break;
+	case OP_SKIP_REG_EQ:
+		ch8_skip_reg_eq(state, opcode);
+		break;
+	case OP_STORE_XO:
+		ch8_store_xo(state, opcode);
+		break;
+	case OP_LOAD_XO:
+		ch8_load_xo(state, opcode);
+		break;
+	case OP_SET_IMM:
+		ch8_set_imm(state, opcode);
+		break;
+	case OP_ADD_IMM:
+		ch8_add_imm(state, opcode);
+		break;
+	case OP_MOV:
+		ch8_mov(state, opcode);
+		break;
+	case OP_OR:
+		ch8_or(state, opcode);
+		break;
+	case OP_AND:
+		ch8_and(state, opcode);
+		break;
+	case OP_XOR:
+		ch8_xor(state, opcode);
+		break;
+	case OP_ADD:
+		ch8_add(state, opcode);
+		break;
+	case OP_SUB_5:
+		ch8_sub_5(state, opcode);
+		break;
+	case OP_LSR:
+		ch8_lsr(state, opcode);
+		break;
+	case OP_SUB_7:
+		ch8_sub_7(state, opcode);
+		break;
+	case OP_LSL:
+		ch8_lsl(state, opcode);
+		break;
+	case OP_SKIP_REG_NEQ:
+		ch8_skip_reg_neq(state, opcode);
+		break;
+	case OP_LOAD_PTR:
+		ch8_load_ptr(state, opcode);
+		break;
+	case OP_JUMP_REG:
+		ch8_jump_reg(state, opcode);
+		break;
+	case OP_RAND:
+		ch8_rand(state, opcode);
+		break;
+	case OP_DRAW:
+		ch8_draw(state, opcode);
+		break;
+	case OP_KEY_SET:
+		ch8_key_set(state, opcode);
+		break;
+	case OP_KEY_UNSET:
+		ch8_key_unset(state, opcode);
+		break;
+	case OP_SET_DRAW_TARGET:
+		ch8_set_draw_target(state, opcode);
+		break;
+	case OP_BUZZER:
+		// f002 - Set buzzer tone. Nop on calculator (XO-CHIP)
+		if (second(opcode))
+			ER_throw(E_INVALID_OPCODE);
+		break;
+	case OP_READ_TIMER:
+		ch8_read_timer(state, opcode);
+		break;
+	case OP_KEY_WAIT:
+		ch8_key_wait(state, opcode);
+		break;
+	case OP_SET_TIMER:
+		ch8_set_timer(state, opcode);
+		break;
+	case OP_SET_SOUND:
+		ch8_set_sound(state, opcode);
+		break;
+	case OP_ADD_PTR:
+		ch8_add_ptr(state, opcode);
+		break;
+	case OP_FONT:
+		ch8_font(state, opcode);
+		break;
+	case OP_FONT_BIG:
+		ch8_font_big(state, opcode);
+		break;
+	case OP_BCD:
+		ch8_bcd(state, opcode);
+		break;
+	case OP_PITCH:
+		// fx3a - Set pitch = x. Nop on calculator (XO-CHIP)
+		break;
+	case OP_STORE:
+		ch8_store(state, opcode);
+		break;
+	case OP_LOAD:
+		ch8_load(state, opcode);
+		break;
+	case OP_RPL_STORE:
+		ch8_rpl_store(state, opcode);
+		break;
+	case OP_RPL_LOAD:
+		ch8_rpl_load(state, opcode);
+		break;
+	case OP_INVALID:
+	default:
+		ER_throw(E_INVALID_OPCODE);
+	}
+}
+
+#else /* !CH8_FLAT_DECODE */
+
 /*
  * Performs dispatching of opcodes to their corresponding handlers. Function
  * pointers are *not* used because they block inlining by the compiler.
@@ -854,6 +1874,8 @@ static void ch8_dispatch(struct ch8_state *state, uint16_t opcode)
 	}
 }
 
+#endif /* CH8_FLAT_DECODE */
+
 /*
  * Executes the next instruction from memory, incrementing the program counter
  * *before* handling the instruction.
@@ -862,9 +1884,13 @@ static void ch8_step(struct ch8_state *state)
 {
 	uint16_t opcode;
 
+	ch8_trace(TRACE_STEP);
+
 	if (state->pc > 0x0FFE)
 		ER_throw(E_INVALID_ADDRESS);
 
+	ch8_trace_pc(state->pc);
+
 	// Loading one byte at a time fixes crashes due to misalignment.
 	opcode = ((*(state->memory + state->pc)) << 8) |
 		 *(state->memory + state->pc + 1);
@@ -875,29 +1901,143 @@ static void ch8_step(struct ch8_state *state)
 }
 
 /*
- * Executes the CHIP-8 program from the given state until an error occurs or a
- * "boss key" is pressed. In the future, this function will also handle creating
- * a pause menu for better user control.
+ * The interpreter loop behind both ch8_run() and the benchmark. Executes the
+ * program until an error occurs, a "boss key" is pressed, or tick_limit timer
+ * ticks have passed, if it is non-zero.
+ *
+ * If tick_period is non-zero, the program runs in virtual time: the timers
+ * tick every tick_period instructions rather than from the timer interrupt.
+ * Memoization is disabled in this mode so that the instruction count, and so
+ * the whole run, doesn't depend on the contents of the memo table.
+ *
+ * The speed governor only makes sense in real time, so it must be off in
+ * virtual time.
  */
-enum ch8_error ch8_run(struct ch8_state *state)
+static enum ch8_error run_loop(struct ch8_state *state, uint16_t tick_period,
+			      uint16_t tick_limit)
 {
+	enum ch8_error result = E_OK;
+	uint16_t ticks = ch8_ticks;
+	uint16_t start = ticks;
+	_Bool f3_held = FALSE;
+	uint16_t steps = 0;
+
+	run_steps = 0;
+	run_draws = 0;
+
+	// Runs without memoization if this fails.
+	if (MEMO_ENABLED && !tick_period)
+		memo_begin(state);
+	ch8_draw_list_new();
+
+	ch8_profile_enter(PROFILE_INTERPRET);
+	governor_reset();
+	ch8_trace_resume();
+
 	TRY
 	{
+		ch8_replay_begin(state);
+
 		while (TRUE) {
 			ch8_step(state);
+			++run_steps;
+
+			// Sleeps out the rest of the frame once it's used its share.
+			if (ch8_governor_on &&
+			    ++frame_steps == ch8_governor_limit)
+				while (ticks == ch8_ticks)
+					idle();
+
+			if (tick_period && ++steps == tick_period) {
+				steps = 0;
+				ch8_timer_tick();
+				ch8_replay_frame(state);
+			}
+
+			// Queued draws are shown once per frame.
+			if (ticks != ch8_ticks) {
+				ticks = ch8_ticks;
+				ch8_draw_list_flush();
+
+				if (ch8_governor_on)
+					governor_frame();
+
+				if (tick_limit &&
+				    (uint16_t)(ticks - start) >= tick_limit)
+					break;
+			}
 
 			if (_keytest(RR_ESC))
 				ER_throw(E_SILENT_EXIT);
 
+			// Benchmarks can only be stopped, not saved or switched.
+			if (tick_limit)
+				continue;
+
 			if (_keytest(RR_F1))
 				ER_throw(E_EXIT_SAVE);
 
+			if (_keytest(RR_F2))
+				ER_throw(E_SWITCH_ROM);
+
+			// Only once per press, as holding F3 would keep saving.
+			if (_keytest(RR_F3) != f3_held) {
+				f3_held = !f3_held;
+				if (f3_held)
+					ch8_quicksave(state);
+			}
+
 			// TODO: Make a pause menu.
 		}
 	}
 	ONERR
 	{
-		return errCode;
+		result = errCode;
+
+		if (result > E_SILENT_EXIT)
+			ch8_trace(TRACE_ERROR_EXIT);
 	}
 	ENDTRY
+
+	ch8_profile_enter(PROFILE_IDLE);
+
+	ch8_draw_list_free();
+	memo_table = NULL;
+
+	return result;
+}
+
+/*
+ * Executes the CHIP-8 program from the given state until an error occurs or a
+ * "boss key" is pressed. In the future, this function will also handle creating
+ * a pause menu for better user control.
+ *
+ * See run_loop() for virtual time and the speed governor.
+ */
+enum ch8_error ch8_run(struct ch8_state *state, uint16_t tick_period)
+{
+	return run_loop(state, tick_period, 0);
+}
+
+/*
+ * Runs the program for the given number of timer ticks in real time, and
+ * counts the instructions and draws it executes. Used by the benchmark, so it
+ * runs the same loop as ch8_run(). Counting starts at the next tick, so that
+ * every run covers whole ticks.
+ */
+enum ch8_error ch8_run_ticks(struct ch8_state *state, uint16_t ticks,
+			     unsigned long *steps, unsigned long *draws)
+{
+	enum ch8_error result;
+	uint16_t start = ch8_ticks;
+
+	while (ch8_ticks == start)
+		;
+
+	result = run_loop(state, 0, ticks);
+
+	*steps = run_steps;
+	*draws = run_draws;
+
+	return result;
 }
@@ -23,6 +23,11 @@ use std::{
 use binary_layout::prelude::*;
 use clap::{Parser, ValueEnum};
 
+mod render;
+mod report;
+mod trace;
+mod transpile;
+
 const MAJOR_VERSION: u8 = 1;
 const MINOR_VERSION: u8 = 0;
 const PATCH_VERSION: u8 = 0;
@@ -37,8 +42,14 @@ struct Args {
     file: String,
 
     /// The target calculator
-    #[clap(long, short, arg_enum, value_parser)]
-    calc: Calc,
+    #[clap(
+        long,
+        short,
+        arg_enum,
+        value_parser,
+        required_unless_present_any = ["render", "report", "transpile", "trace"]
+    )]
+    calc: Option<Calc>,
 
     /// On-calculator variable name, clipped to 8 characters (Optional)
     #[clap(long, short, value_parser)]
@@ -51,6 +62,26 @@ struct Args {
     /// The file to place output in (Optional)
     #[clap(long, short, value_parser)]
     output: Option<String>,
+
+    /// Render the screen of a savestate file as a PAM image, scaled by this factor
+    #[clap(long, short, value_parser)]
+    render: Option<u8>,
+
+    /// Colours used by --render
+    #[clap(default_value = "calc", long, arg_enum, value_parser)]
+    palette: render::PaletteName,
+
+    /// Disassemble the ROM and estimate the calculator cycles of each block
+    #[clap(long, arg_enum, value_parser)]
+    report: Option<report::ReportFormat>,
+
+    /// Translate the ROM's code into C, for running it natively on a host
+    #[clap(long, value_parser)]
+    transpile: bool,
+
+    /// Analyse the hot blocks, loops and opcodes in a trace from a -DCH8_TRACE build
+    #[clap(long, value_parser)]
+    trace: bool,
 }
 
 #[derive(Clone, ValueEnum)]
@@ -79,9 +110,14 @@ define_layout!(ch8_header, BigEndian, {
 });
 
 static OTH_CH8: [u8; 6] = [0, b'c', b'h', b'8', 0, 0xF8];
+static OTH_C8SV: [u8; 7] = [0, b'c', b'8', b's', b'v', 0, 0xF8];
+static OTH_C8TR: [u8; 7] = [0, b'c', b'8', b't', b'r', 0, 0xF8];
+
+/// sizeof(struct ch8_state) on the calculator.
+const STATE_SIZE: usize = 6228;
 
 /// (Output path, stripped input filename)
-fn get_filename(args: &Args) -> (String, String) {
+fn get_filename(args: &Args, calc: &Calc) -> (String, String) {
     let mut path = args.file.as_str();
     path = path.strip_suffix(".ch8").unwrap_or(path);
     path = path.strip_suffix(".rom").unwrap_or(path);
@@ -94,7 +130,7 @@ fn get_filename(args: &Args) -> (String, String) {
                 None => path,
             }
             .to_string();
-            x.push_str(match args.calc {
+            x.push_str(match calc {
                 Calc::TI89 => ".89y",
                 Calc::TI92P => ".9xy",
                 Calc::V200 => ".v2y",
@@ -193,6 +229,82 @@ fn compress(src: Vec<u8>) -> Vec<u8> {
     output
 }
 
+/// The inverse of compress().
+fn decompress(src: &[u8]) -> Vec<u8> {
+    let mut output: Vec<u8> = Vec::new();
+    let mut i = 0;
+
+    while i < src.len() {
+        if src[i] != 0xFF {
+            output.push(src[i]);
+            i += 1;
+            continue;
+        }
+
+        let (control, low) = match src.get(i + 1..i + 3) {
+            Some(&[control, low]) => (control, low),
+            _ => (src.get(i + 1).copied().unwrap_or(0), 0),
+        };
+        let len = (control & 63) as usize;
+
+        if len == 0 {
+            output.push(0xFF);
+            i += 2;
+            continue;
+        }
+
+        // Malformed input stops here, and is caught by the length check.
+        let distance = ((control as usize & 0xC0) << 2 | low as usize) + 1;
+        if distance > output.len() {
+            break;
+        }
+
+        for _ in 0..len {
+            output.push(output[output.len() - distance]);
+        }
+        i += 3;
+    }
+
+    output
+}
+
+/// Extracts the contents of a variable file with the given type tag. The
+/// contents are followed by the tag and the file checksum.
+fn var_contents<'a>(file: &'a [u8], tag: &[u8], kind: &str) -> Result<&'a [u8], Error> {
+    let start = ch8_header::datasize::OFFSET + 2;
+    let tag_start = file
+        .len()
+        .checked_sub(2 + tag.len())
+        .filter(|&end| end >= start)
+        .ok_or_else(|| Error::from(ErrorKind::InvalidData))?;
+
+    if file[tag_start..tag_start + tag.len()] != *tag {
+        return Err(Error::new(
+            ErrorKind::InvalidData,
+            format!("not a {}", kind),
+        ));
+    }
+
+    Ok(&file[start..tag_start])
+}
+
+/// Extracts the struct ch8_state from a c8sv variable file, decompressing it
+/// if needed.
+fn read_savestate(file: &[u8]) -> Result<Vec<u8>, Error> {
+    let data = var_contents(file, &OTH_C8SV, "savestate")?;
+    let state = if data.len() == STATE_SIZE {
+        data.to_vec()
+    } else {
+        decompress(data)
+    };
+
+    if state.len() != STATE_SIZE {
+        return Err(Error::new(ErrorKind::InvalidData, "corrupt savestate"));
+    }
+
+    Ok(state)
+}
+
 fn fill_header(
     mut header: ch8_header::View<&mut [u8]>,
     calc: Calc,
@@ -244,10 +356,100 @@ fn compute_checksum(data: &[&[u8]]) -> [u8; 2] {
         .to_le_bytes()
 }
 
+/// Writes the screen saved in a savestate to an image next to it.
+fn render_savestate(args: &Args, scale: u8) -> Result<(), Error> {
+    if scale == 0 {
+        return Err(Error::new(
+            ErrorKind::InvalidInput,
+            "scale must be at least 1",
+        ));
+    }
+
+    let mut file = Vec::new();
+    File::open(&args.file)?.read_to_end(&mut file)?;
+
+    let state = read_savestate(&file)?;
+    let display = render::find_display(&state)?;
+    let rgba = render::to_rgba(display, &args.palette, scale.into());
+
+    let output = match &args.output {
+        Some(s) => s.clone(),
+        None => {
+            let (path, _) = args.file.rsplit_once('.').unwrap_or((&args.file, ""));
+            format!("{}.pam", path)
+        }
+    };
+
+    render::write_pam(&mut File::create(output)?, &rgba, scale.into())
+}
+
+/// Reads a raw ROM that fits in CHIP-8 memory.
+fn read_rom(args: &Args) -> Result<Vec<u8>, Error> {
+    let mut rom = Vec::new();
+    File::open(&args.file)?.read_to_end(&mut rom)?;
+
+    if rom.len() > 0x1000 - 0x200 {
+        return Err(Error::from(ErrorKind::InvalidData));
+    }
+
+    Ok(rom)
+}
+
+/// Writes text to the output file, or stdout.
+fn write_output(args: &Args, text: &str) -> Result<(), Error> {
+    match &args.output {
+        Some(path) => File::create(path)?.write_all(text.as_bytes()),
+        None => std::io::stdout().write_all(text.as_bytes()),
+    }
+}
+
+/// Writes a cost report for a ROM.
+fn report_rom(args: &Args, format: &report::ReportFormat) -> Result<(), Error> {
+    let rom = read_rom(args)?;
+
+    write_output(args, &report::report(&rom, format))
+}
+
+/// Writes the analysis of a trace captured on the calculator.
+fn analyse_trace(args: &Args) -> Result<(), Error> {
+    let mut file = Vec::new();
+    File::open(&args.file)?.read_to_end(&mut file)?;
+
+    let trace = trace::parse(var_contents(&file, &OTH_C8TR, "trace")?)?;
+
+    write_output(args, &trace::report(&trace))
+}
+
+/// Writes the C translation of a ROM.
+fn transpile_rom(args: &Args) -> Result<(), Error> {
+    let rom = read_rom(args)?;
+
+    write_output(args, &transpile::transpile(&rom))
+}
+
 fn main() -> Result<(), Error> {
     let args = Args::parse();
 
-    let (output, filename) = get_filename(&args);
+    if let Some(scale) = args.render {
+        return render_savestate(&args, scale);
+    }
+
+    if let Some(format) = &args.report {
+        return report_rom(&args, format);
+    }
+
+    if args.transpile {
+        return transpile_rom(&args);
+    }
+
+    if args.trace {
+        return analyse_trace(&args);
+    }
+
+    // Clap guarantees this is set when not rendering.
+    let calc = args.calc.clone().unwrap();
+
+    let (output, filename) = get_filename(&args, &calc);
 
     let mut rom = File::open(&args.file)?;
     let mut storage = Vec::new();
@@ -263,7 +465,7 @@ fn main() -> Result<(), Error> {
 
     fill_header(
         ch8_header::View::new(&mut header_storage),
-        args.calc,
+        calc,
         &args.folder,
         &filename,
         storage.len(),
@@ -0,0 +1,130 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Turns the two display planes stored in a savestate into an RGBA image.
+
+use std::io::{Error, ErrorKind, Write};
+
+use clap::ValueEnum;
+
+pub const WIDTH: usize = 128;
+pub const HEIGHT: usize = 64;
+
+/// Bytes per plane, as laid out by save_chip8_screen() on the calculator.
+const PLANE_SIZE: usize = WIDTH * HEIGHT / 8;
+
+/// Colours for (neither plane, light plane, dark plane, both planes).
+type Palette = [[u8; 4]; 4];
+
+#[derive(Clone, ValueEnum)]
+pub enum PaletteName {
+    /// Grayscale, as shown on the calculator
+    Calc,
+    /// Octo's default XO-CHIP colours
+    Octo,
+}
+
+impl PaletteName {
+    fn colours(&self) -> &'static Palette {
+        match self {
+            PaletteName::Calc => &[
+                [0xFF, 0xFF, 0xFF, 0xFF],
+                [0xAA, 0xAA, 0xAA, 0xFF],
+                [0x55, 0x55, 0x55, 0xFF],
+                [0x00, 0x00, 0x00, 0xFF],
+            ],
+            PaletteName::Octo => &[
+                [0x99, 0x66, 0x00, 0xFF],
+                [0xFF, 0xCC, 0x00, 0xFF],
+                [0xFF, 0x66, 0x00, 0xFF],
+                [0x66, 0x22, 0x00, 0xFF],
+            ],
+        }
+    }
+}
+
+/// Spreads the bits of x out so that bit i ends up in bit 2i.
+fn spread(x: u16) -> u32 {
+    let mut x = x as u32;
+    x = (x | x << 8) & 0x00FF_00FF;
+    x = (x | x << 4) & 0x0F0F_0F0F;
+    x = (x | x << 2) & 0x3333_3333;
+    (x | x << 1) & 0x5555_5555
+}
+
+/// Converts both planes into RGBA pixels, drawing every CHIP-8 pixel as a
+/// scale x scale block.
+///
+/// Pixels are handled 16 at a time: the light and dark words are interleaved
+/// into one 32-bit word of 2-bit palette indices. Each output row is only
+/// built once and then copied for the rest of its block.
+pub fn to_rgba(display: &[u8], palette: &PaletteName, scale: usize) -> Vec<u8> {
+    let palette = palette.colours();
+    let row_len = WIDTH * scale * 4;
+    let word_len = 16 * scale * 4;
+    let mut out = vec![0u8; row_len * HEIGHT * scale];
+
+    for (y, rows) in out.chunks_exact_mut(row_len * scale).enumerate() {
+        let (first, rest) = rows.split_at_mut(row_len);
+
+        for (word, pixels) in first.chunks_exact_mut(word_len).enumerate() {
+            let at = y * WIDTH / 8 + word * 2;
+            let light = u16::from_be_bytes([display[at], display[at + 1]]);
+            let dark = u16::from_be_bytes([display[PLANE_SIZE + at], display[PLANE_SIZE + at + 1]]);
+
+            // The leftmost pixel ends up in the top two bits.
+            let indices = spread(light) | spread(dark) << 1;
+
+            for (i, block) in pixels.chunks_exact_mut(scale * 4).enumerate() {
+                let colour = &palette[(indices >> (30 - 2 * i)) as usize & 3];
+                for pixel in block.chunks_exact_mut(4) {
+                    pixel.copy_from_slice(colour);
+                }
+            }
+        }
+
+        for row in rest.chunks_exact_mut(row_len) {
+            row.copy_from_slice(first);
+        }
+    }
+
+    out
+}
+
+/// Writes RGBA pixels from to_rgba() as a PAM image.
+pub fn write_pam(dest: &mut impl Write, rgba: &[u8], scale: usize) -> Result<(), Error> {
+    write!(
+        dest,
+        "P7\nWIDTH {}\nHEIGHT {}\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+        WIDTH * scale,
+        HEIGHT * scale
+    )?;
+    dest.write_all(rgba)
+}
+
+/// Finds the saved display planes in a struct ch8_state.
+///
+/// The planes are followed by rpl_fake at the end of the struct.
+pub fn find_display(state: &[u8]) -> Result<&[u8], Error> {
+    const RPL_SIZE: usize = 16;
+
+    let start = state
+        .len()
+        .checked_sub(RPL_SIZE + 2 * PLANE_SIZE)
+        .ok_or_else(|| Error::from(ErrorKind::InvalidData))?;
+
+    Ok(&state[start..start + 2 * PLANE_SIZE])
+}
@@ -0,0 +1,446 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Static disassembly of a ROM, with an estimate of how many 68000 cycles
+//! each basic block costs on the calculator.
+
+use std::collections::{BTreeSet, HashSet};
+use std::fmt::Write;
+
+use clap::ValueEnum;
+
+#[derive(Clone, ValueEnum)]
+pub enum ReportFormat {
+    Text,
+    Json,
+}
+
+/// Cycles available per 60Hz frame on a 12MHz TI-89 HW2, TI-92+ or V200.
+pub const FRAME_BUDGET: u32 = 12_000_000 / 60;
+
+/// Fetch, ch8_dispatch(), the ESC/F1 keytests and the tick check, which every
+/// instruction pays for.
+pub const STEP_CYCLES: u32 = 180;
+
+const ENTRY: u16 = 0x200;
+
+pub fn opcode(memory: &[u8], addr: u16) -> u16 {
+    u16::from_be_bytes([memory[addr as usize], memory[addr as usize + 1]])
+}
+
+pub fn x(op: u16) -> u16 {
+    (op & 0x0F00) >> 8
+}
+
+pub fn y(op: u16) -> u16 {
+    (op & 0x00F0) >> 4
+}
+
+pub fn n(op: u16) -> u16 {
+    op & 0xF
+}
+
+/// Disassembles a single opcode. Opcodes the calculator rejects with
+/// E_INVALID_OPCODE come out as None.
+pub fn disassemble(op: u16) -> Option<String> {
+    let (x, y, n, nn, nnn) = (x(op), y(op), n(op), op & 0xFF, op & 0xFFF);
+
+    Some(match op >> 12 {
+        0x0 if op & 0xFFF0 == 0x00C0 => format!("scd {}", n),
+        0x0 if op & 0xFFF0 == 0x00D0 => format!("scu {}", n),
+        0x0 => match op {
+            0x00E0 => "cls".to_string(),
+            0x00EE => "ret".to_string(),
+            0x00FB => "scr".to_string(),
+            0x00FC => "scl".to_string(),
+            0x00FD => "exit".to_string(),
+            0x00FE => "low".to_string(),
+            0x00FF => "high".to_string(),
+            _ => return None,
+        },
+        0x1 => format!("jp {:#05x}", nnn),
+        0x2 => format!("call {:#05x}", nnn),
+        0x3 => format!("se v{:x}, {:#04x}", x, nn),
+        0x4 => format!("sne v{:x}, {:#04x}", x, nn),
+        0x5 => match n {
+            0x0 => format!("se v{:x}, v{:x}", x, y),
+            0x2 => format!("save v{:x}-v{:x}", x, y),
+            0x3 => format!("load v{:x}-v{:x}", x, y),
+            _ => return None,
+        },
+        0x6 => format!("ld v{:x}, {:#04x}", x, nn),
+        0x7 => format!("add v{:x}, {:#04x}", x, nn),
+        0x8 => {
+            let name = match n {
+                0x0 => "ld",
+                0x1 => "or",
+                0x2 => "and",
+                0x3 => "xor",
+                0x4 => "add",
+                0x5 => "sub",
+                0x6 => "shr",
+                0x7 => "subn",
+                0xE => "shl",
+                _ => return None,
+            };
+            format!("{} v{:x}, v{:x}", name, x, y)
+        }
+        0x9 if n == 0 => format!("sne v{:x}, v{:x}", x, y),
+        0xA => format!("ld i, {:#05x}", nnn),
+        0xB => format!("jp v0, {:#05x}", nnn),
+        0xC => format!("rnd v{:x}, {:#04x}", x, nn),
+        0xD => format!("drw v{:x}, v{:x}, {}", x, y, n),
+        0xE if nn == 0x9E => format!("skp v{:x}", x),
+        0xE if nn == 0xA1 => format!("sknp v{:x}", x),
+        0xF => match nn {
+            0x01 if x <= 3 => format!("plane {}", x),
+            0x02 if x == 0 => "audio".to_string(),
+            0x07 => format!("ld v{:x}, dt", x),
+            0x0A => format!("ld v{:x}, k", x),
+            0x15 => format!("ld dt, v{:x}", x),
+            0x18 => format!("ld st, v{:x}", x),
+            0x1E => format!("add i, v{:x}", x),
+            0x29 => format!("ld f, v{:x}", x),
+            0x30 => format!("ld hf, v{:x}", x),
+            0x33 => format!("ld b, v{:x}", x),
+            0x3A => format!("pitch v{:x}", x),
+            0x55 => format!("ld [i], v{:x}", x),
+            0x65 => format!("ld v{:x}, [i]", x),
+            0x75 => format!("ld r, v{:x}", x),
+            0x85 => format!("ld v{:x}, r", x),
+            _ => return None,
+        },
+        _ => return None,
+    })
+}
+
+/// Estimated 68000 cycles for one trip through ch8_run() with this opcode,
+/// on top of STEP_CYCLES. These are hand counts of the handlers in opcodes.c
+/// and sprite.c as compiled with -Os, so treat them as estimates: they are
+/// meant to rank blocks and spot outliers, not to predict exact timings.
+pub fn handler_cycles(op: u16, hires: bool) -> u32 {
+    // One 32-bit read-modify-write of a plane row in _draw_sprite_16_hi().
+    const ROW_CYCLES: u32 = 150;
+
+    let rows = if n(op) == 0 { 16 } else { n(op) as u32 };
+
+    STEP_CYCLES
+        + match op >> 12 {
+            0x0 => match op {
+                // Four long-word stores per window row, both planes.
+                0x00E0 => 64 * 2 * 80,
+                0x00EE => 60,
+                // Word-at-a-time shift of every window row.
+                0x00FB | 0x00FC => 64 * 8 * 2 * 50,
+                _ if op & 0xFFE0 == 0x00C0 => 64 * 2 * 90,
+                _ => 20,
+            },
+            0x1 => 20,
+            // Push plus the memoization lookup.
+            0x2 => 200,
+            0x3 | 0x4 | 0x5 | 0x9 => 50,
+            0x6 | 0x7 | 0xA => 30,
+            0x8 => 70,
+            0xB => 40,
+            0xC => 400,
+            0xD if hires && n(op) == 0 => 300 + rows * 2 * ROW_CYCLES,
+            // The 8-pixel hi-res path widens each row first.
+            0xD if hires => 300 + rows * (40 + 2 * ROW_CYCLES),
+            // Lo-res sprites are doubled in both directions first.
+            0xD => 400 + rows * (350 + 2 * 2 * ROW_CYCLES),
+            // read_keyboard() scans the whole keyboard.
+            0xE => 800,
+            0xF => match op & 0xFF {
+                0x0A => 800,
+                0x33 => 600,
+                0x55 | 0x65 | 0x75 | 0x85 => 60 + 40 * (x(op) as u32 + 1),
+                _ => 50,
+            },
+            _ => 0,
+        }
+}
+
+fn is_skip(op: u16) -> bool {
+    matches!(op >> 12, 0x3 | 0x4)
+        || (matches!(op >> 12, 0x5 | 0x9) && n(op) == 0)
+        || (op >> 12 == 0xE && matches!(op & 0xFF, 0x9E | 0xA1))
+}
+
+/// Where control can go after op at addr, and whether op ends a block.
+fn successors(op: u16, addr: u16) -> (Vec<u16>, bool) {
+    let next = addr + 2;
+
+    if disassemble(op).is_none() {
+        return (vec![], true);
+    }
+
+    match op >> 12 {
+        0x1 => (vec![op & 0xFFF], true),
+        0x2 => (vec![op & 0xFFF, next], true),
+        0xB => (vec![], true),
+        0x0 if op == 0x00EE || op == 0x00FD => (vec![], true),
+        _ if is_skip(op) => (vec![next, next + 2], true),
+        _ => (vec![next], false),
+    }
+}
+
+struct Block {
+    start: u16,
+    /// Address of the last instruction.
+    last: u16,
+    succs: Vec<u16>,
+    /// Cycles for one pass through the block, including any routine it calls.
+    cycles: u32,
+    /// Cycles for one trip around the loop containing the block, if any.
+    loop_cycles: Option<u32>,
+}
+
+impl Block {
+    fn over_budget(&self) -> bool {
+        self.loop_cycles.unwrap_or(self.cycles) > FRAME_BUDGET
+    }
+}
+
+fn in_range(addr: u16) -> bool {
+    (ENTRY..=0xFFE).contains(&addr)
+}
+
+/// Finds every reachable instruction and the addresses that start blocks.
+fn discover(memory: &[u8]) -> (HashSet<u16>, BTreeSet<u16>) {
+    let mut reachable = HashSet::new();
+    let mut leaders = BTreeSet::from([ENTRY]);
+    let mut work = vec![ENTRY];
+
+    while let Some(addr) = work.pop() {
+        if !in_range(addr) || !reachable.insert(addr) {
+            continue;
+        }
+
+        let (succs, ends) = successors(opcode(memory, addr), addr);
+        for &s in succs.iter().filter(|&&s| in_range(s)) {
+            if ends {
+                leaders.insert(s);
+            }
+            work.push(s);
+        }
+    }
+
+    (reachable, leaders)
+}
+
+fn build_blocks(memory: &[u8], hires: bool) -> Vec<Block> {
+    let (reachable, leaders) = discover(memory);
+    let mut blocks = Vec::new();
+
+    for &start in leaders.iter().filter(|a| reachable.contains(a)) {
+        let mut addr = start;
+        let mut cycles = 0;
+
+        loop {
+            let op = opcode(memory, addr);
+            let (succs, ends) = successors(op, addr);
+            cycles += handler_cycles(op, hires);
+
+            let next = addr + 2;
+            if ends || leaders.contains(&next) || !reachable.contains(&next) {
+                blocks.push(Block {
+                    start,
+                    last: addr,
+                    succs: succs.into_iter().filter(|&s| in_range(s)).collect(),
+                    cycles,
+                    loop_cycles: None,
+                });
+                break;
+            }
+            addr = next;
+        }
+    }
+
+    blocks
+}
+
+/// Marks which blocks each block can reach, as a matrix indexed by block.
+fn reachability(blocks: &[Block]) -> Vec<Vec<bool>> {
+    let index = |addr: u16| blocks.iter().position(|b| b.start == addr);
+
+    blocks
+        .iter()
+        .map(|b| {
+            let mut seen = vec![false; blocks.len()];
+            let mut work: Vec<usize> = b.succs.iter().filter_map(|&s| index(s)).collect();
+
+            while let Some(i) = work.pop() {
+                if !seen[i] {
+                    seen[i] = true;
+                    work.extend(blocks[i].succs.iter().filter_map(|&s| index(s)));
+                }
+            }
+            seen
+        })
+        .collect()
+}
+
+/// Adds callee costs to blocks ending in a call, then costs every loop.
+///
+/// A call is charged one pass over everything reachable from its target, and
+/// a loop is charged one pass over every block in it. Both are upper bounds
+/// for a single iteration, since not every path is taken every time.
+fn cost_blocks(memory: &[u8], blocks: &mut [Block]) {
+    let reach = reachability(blocks);
+    let own: Vec<u32> = blocks.iter().map(|b| b.cycles).collect();
+    let starts: Vec<u16> = blocks.iter().map(|b| b.start).collect();
+    let index = |addr: u16| starts.iter().position(|&s| s == addr);
+
+    for i in 0..blocks.len() {
+        let op = opcode(memory, blocks[i].last);
+        if op >> 12 != 0x2 {
+            continue;
+        }
+        if let Some(callee) = index(op & 0xFFF) {
+            let body: u32 = (0..blocks.len())
+                .filter(|&j| j == callee || reach[callee][j])
+                .map(|j| own[j])
+                .sum();
+            blocks[i].cycles += body;
+        }
+    }
+
+    for i in 0..blocks.len() {
+        if reach[i][i] {
+            let total = (0..blocks.len())
+                .filter(|&j| reach[i][j] && reach[j][i])
+                .map(|j| blocks[j].cycles)
+                .sum();
+            blocks[i].loop_cycles = Some(total);
+        }
+    }
+}
+
+/// Places a raw ROM image in an otherwise empty 4KB address space.
+pub fn load(rom: &[u8]) -> Vec<u8> {
+    let mut memory = vec![0u8; 0x1000];
+    memory[ENTRY as usize..ENTRY as usize + rom.len()].copy_from_slice(rom);
+    memory
+}
+
+/// The first and last instruction of every reachable basic block.
+pub fn block_ranges(memory: &[u8]) -> Vec<(u16, u16)> {
+    build_blocks(memory, false)
+        .iter()
+        .map(|b| (b.start, b.last))
+        .collect()
+}
+
+/// Produces the report for a raw ROM image.
+pub fn report(rom: &[u8], format: &ReportFormat) -> String {
+    let memory = load(rom);
+
+    // Whether sprites are drawn in hi-res can't be known statically, so assume
+    // they are if the rom ever switches to hi-res.
+    let (reachable, _) = discover(&memory);
+    let hires = reachable.iter().any(|&a| opcode(&memory, a) == 0x00FF);
+
+    let mut blocks = build_blocks(&memory, hires);
+    cost_blocks(&memory, &mut blocks);
+
+    match format {
+        ReportFormat::Text => text_report(&memory, &blocks),
+        ReportFormat::Json => json_report(&memory, &blocks),
+    }
+}
+
+fn instructions<'a>(
+    memory: &'a [u8],
+    block: &Block,
+) -> impl Iterator<Item = (u16, u16, String)> + 'a {
+    let (start, last) = (block.start, block.last);
+    (start..=last).step_by(2).map(move |a| {
+        let op = opcode(memory, a);
+        (
+            a,
+            op,
+            disassemble(op).unwrap_or_else(|| "invalid".to_string()),
+        )
+    })
+}
+
+fn text_report(memory: &[u8], blocks: &[Block]) -> String {
+    let mut out = String::new();
+
+    writeln!(out, "Frame budget: {} cycles", FRAME_BUDGET).unwrap();
+
+    for block in blocks {
+        write!(
+            out,
+            "\n{:#05x}-{:#05x}: {} cycles",
+            block.start, block.last, block.cycles
+        )
+        .unwrap();
+        if let Some(c) = block.loop_cycles {
+            write!(out, ", {} cycles per loop iteration", c).unwrap();
+        }
+        if block.over_budget() {
+            write!(out, " [OVER FRAME BUDGET]").unwrap();
+        }
+        writeln!(out).unwrap();
+
+        for (addr, op, text) in instructions(memory, block) {
+            writeln!(out, "  {:#05x}  {:04X}  {}", addr, op, text).unwrap();
+        }
+    }
+
+    out
+}
+
+fn json_report(memory: &[u8], blocks: &[Block]) -> String {
+    let mut out = String::new();
+
+    write!(out, "{{\"frame_budget\":{},\"blocks\":[", FRAME_BUDGET).unwrap();
+
+    for (i, block) in blocks.iter().enumerate() {
+        if i > 0 {
+            out.push(',');
+        }
+        write!(
+            out,
+            "{{\"start\":{},\"last\":{},\"cycles\":{},\"loop_cycles\":{},\"over_budget\":{},\"instructions\":[",
+            block.start,
+            block.last,
+            block.cycles,
+            block
+                .loop_cycles
+                .map_or("null".to_string(), |c| c.to_string()),
+            block.over_budget()
+        )
+        .unwrap();
+
+        for (j, (addr, op, text)) in instructions(memory, block).enumerate() {
+            if j > 0 {
+                out.push(',');
+            }
+            write!(
+                out,
+                "{{\"addr\":{},\"opcode\":{},\"text\":\"{}\"}}",
+                addr, op, text
+            )
+            .unwrap();
+        }
+        out.push_str("]}");
+    }
+
+    out.push_str("]}\n");
+    out
+}
@@ -0,0 +1,451 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Analysis of the control flow captured by a -DCH8_TRACE build: the basic
+//! blocks and loops that actually ran, ranked by how many instructions they
+//! executed, how often each opcode and pair of opcodes ran, and what some
+//! candidate interpreter optimisations would have saved on that workload.
+
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::io::{Error, ErrorKind};
+
+use crate::report::{disassemble, handler_cycles, n, opcode, FRAME_BUDGET, STEP_CYCLES};
+
+/// Layout of struct ch8_trace_file in trace.c.
+const MEMORY_SIZE: usize = 0x1000;
+const COUNTS_OFFSET: usize = MEMORY_SIZE + 2;
+const ODD_PCS_OFFSET: usize = COUNTS_OFFSET + 4 * MEMORY_SIZE / 2;
+const LOST_OFFSET: usize = ODD_PCS_OFFSET + 4;
+const EDGE_COUNT_OFFSET: usize = LOST_OFFSET + 4;
+const EDGES_OFFSET: usize = EDGE_COUNT_OFFSET + 2;
+const EDGE_SIZE: usize = 8;
+
+/// How many blocks, opcodes and pairs to list.
+const TOP: usize = 10;
+
+struct Edge {
+    from: u16,
+    to: u16,
+    count: u64,
+}
+
+pub struct Trace {
+    memory: Vec<u8>,
+    hires: bool,
+    counts: Vec<u64>,
+    odd_pcs: u64,
+    lost_edges: u32,
+    edges: Vec<Edge>,
+}
+
+fn be16(data: &[u8], at: usize) -> u16 {
+    u16::from_be_bytes([data[at], data[at + 1]])
+}
+
+fn be32(data: &[u8], at: usize) -> u32 {
+    u32::from_be_bytes([data[at], data[at + 1], data[at + 2], data[at + 3]])
+}
+
+/// Parses the contents of a c8tr variable, without the size or tag.
+pub fn parse(data: &[u8]) -> Result<Trace, Error> {
+    let corrupt = || Error::new(ErrorKind::InvalidData, "corrupt trace");
+
+    if data.len() < EDGES_OFFSET {
+        return Err(corrupt());
+    }
+
+    let edge_count = be16(data, EDGE_COUNT_OFFSET) as usize;
+    if data.len() != EDGES_OFFSET + edge_count * EDGE_SIZE {
+        return Err(corrupt());
+    }
+
+    Ok(Trace {
+        memory: data[..MEMORY_SIZE].to_vec(),
+        hires: data[MEMORY_SIZE] != 0,
+        counts: (0..MEMORY_SIZE / 2)
+            .map(|i| be32(data, COUNTS_OFFSET + 4 * i).into())
+            .collect(),
+        odd_pcs: be32(data, ODD_PCS_OFFSET).into(),
+        lost_edges: be32(data, LOST_OFFSET),
+        edges: (0..edge_count)
+            .map(|i| {
+                let at = EDGES_OFFSET + i * EDGE_SIZE;
+                Edge {
+                    from: be16(data, at),
+                    to: be16(data, at + 2),
+                    count: be32(data, at + 4).into(),
+                }
+            })
+            .collect(),
+    })
+}
+
+/// Groups opcodes by instruction, hiding their operands.
+fn class(op: u16) -> String {
+    match op >> 12 {
+        0x0 if op & 0xFFE0 == 0x00C0 => format!("00{:X}N", (op >> 4) & 0xF),
+        0x0 => format!("{:04X}", op),
+        0x1 | 0x2 | 0xA | 0xB => format!("{:X}NNN", op >> 12),
+        0x3 | 0x4 | 0x6 | 0x7 | 0xC => format!("{:X}XNN", op >> 12),
+        0x5 | 0x8 | 0x9 => format!("{:X}XY{:X}", op >> 12, n(op)),
+        0xD => "DXYN".to_string(),
+        _ => format!("{:X}X{:02X}", op >> 12, op & 0xFF),
+    }
+}
+
+/// Instructions that only touch registers and control flow, so a loop made of
+/// them could be run ahead in one step. Timer reads and key skips also qualify,
+/// but make the loop wait on the outside world instead.
+fn is_register_only(op: u16) -> bool {
+    match op >> 12 {
+        0x1 | 0x3 | 0x4 | 0x6 | 0x7 | 0xA => true,
+        0x5 | 0x9 => n(op) == 0,
+        0x8 => disassemble(op).is_some(),
+        0xF => op & 0xFF == 0x1E,
+        _ => false,
+    }
+}
+
+fn is_wait(op: u16) -> bool {
+    (op >> 12 == 0xF && op & 0xFF == 0x07) || (op >> 12 == 0xE && matches!(op & 0xFF, 0x9E | 0xA1))
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum LoopKind {
+    /// Polls the delay timer or keys, and could idle until they change.
+    Idle,
+    /// Only computes on registers, and could be fast-forwarded.
+    Compute,
+    Other,
+}
+
+struct Block {
+    start: u16,
+    last: u16,
+    entries: u64,
+    instructions: u64,
+    cycles: u64,
+}
+
+struct Loop {
+    start: u16,
+    last: u16,
+    iterations: u64,
+    instructions: u64,
+    cycles: u64,
+    kind: LoopKind,
+}
+
+impl Loop {
+    /// Cycles spent on every pass but the first of each entry, which is what
+    /// skipping or fast-forwarding the loop would save.
+    fn repeat_cycles(&self, passes: u64) -> u64 {
+        self.cycles * self.iterations / passes.max(1)
+    }
+
+    fn contains(&self, other: &Loop) -> bool {
+        self.start <= other.start
+            && other.last <= self.last
+            && (self.start, self.last) != (other.start, other.last)
+    }
+}
+
+impl Trace {
+    fn count(&self, addr: u16) -> u64 {
+        self.counts[addr as usize / 2]
+    }
+
+    fn op(&self, addr: u16) -> u16 {
+        opcode(&self.memory, addr)
+    }
+
+    fn cycles(&self, addr: u16) -> u64 {
+        self.count(addr) * handler_cycles(self.op(addr), self.hires) as u64
+    }
+
+    fn executed(&self) -> impl Iterator<Item = u16> + '_ {
+        (0..MEMORY_SIZE as u16)
+            .step_by(2)
+            .filter(|&a| self.count(a) > 0)
+    }
+
+    /// Times control left addr for anything but the next instruction.
+    fn taken(&self, addr: u16) -> u64 {
+        self.edges
+            .iter()
+            .filter(|e| e.from == addr)
+            .map(|e| e.count)
+            .sum()
+    }
+
+    /// Splits the executed instructions into blocks that were always entered
+    /// at the top and left at the bottom.
+    fn blocks(&self) -> Vec<Block> {
+        let is_leader = |a: u16| {
+            a == 0
+                || self.count(a - 2) == 0
+                || self.edges.iter().any(|e| e.to == a || e.from == a - 2)
+        };
+        let mut blocks: Vec<Block> = Vec::new();
+
+        for addr in self.executed() {
+            match blocks.last_mut() {
+                Some(b) if b.last + 2 == addr && !is_leader(addr) => {
+                    b.last = addr;
+                    b.instructions += self.count(addr);
+                    b.cycles += self.cycles(addr);
+                }
+                _ => blocks.push(Block {
+                    start: addr,
+                    last: addr,
+                    entries: self.count(addr),
+                    instructions: self.count(addr),
+                    cycles: self.cycles(addr),
+                }),
+            }
+        }
+
+        blocks
+    }
+
+    /// Every backward jump or skip closes a loop over the addresses it jumps
+    /// across. Routines called from the loop aren't counted as part of it.
+    fn loops(&self) -> Vec<Loop> {
+        let is_call_or_ret = |op: u16| op >> 12 == 0x2 || op == 0x00EE;
+        let mut loops: Vec<Loop> = self
+            .edges
+            .iter()
+            .filter(|e| e.to <= e.from && !is_call_or_ret(self.op(e.from)))
+            .map(|e| {
+                let body: Vec<u16> = (e.to..=e.from)
+                    .step_by(2)
+                    .filter(|&a| self.count(a) > 0)
+                    .collect();
+                let ops = || body.iter().map(|&a| self.op(a));
+
+                let kind = if !ops().all(|op| is_register_only(op) || is_wait(op)) {
+                    LoopKind::Other
+                } else if ops().any(is_wait) {
+                    LoopKind::Idle
+                } else {
+                    LoopKind::Compute
+                };
+
+                Loop {
+                    start: e.to,
+                    last: e.from,
+                    iterations: e.count,
+                    instructions: body.iter().map(|&a| self.count(a)).sum(),
+                    cycles: body.iter().map(|&a| self.cycles(a)).sum(),
+                    kind,
+                }
+            })
+            .collect();
+
+        loops.sort_by(|a, b| b.instructions.cmp(&a.instructions));
+        loops
+    }
+
+    /// Dynamic counts of each opcode, and of each pair of opcodes that ran one
+    /// after the other, either falling through or along an edge.
+    fn grams(&self) -> (HashMap<String, (u64, u64)>, HashMap<(String, String), u64>) {
+        let mut singles: HashMap<String, (u64, u64)> = HashMap::new();
+        let mut pairs: HashMap<(String, String), u64> = HashMap::new();
+
+        for addr in self.executed() {
+            let entry = singles.entry(class(self.op(addr))).or_default();
+            entry.0 += self.count(addr);
+            entry.1 += self.cycles(addr);
+
+            let through = self.count(addr).saturating_sub(self.taken(addr));
+            if through > 0 && (addr as usize) + 2 < MEMORY_SIZE {
+                *pairs
+                    .entry((class(self.op(addr)), class(self.op(addr + 2))))
+                    .or_default() += through;
+            }
+        }
+
+        for e in &self.edges {
+            *pairs
+                .entry((class(self.op(e.from)), class(self.op(e.to))))
+                .or_default() += e.count;
+        }
+
+        (singles, pairs)
+    }
+}
+
+fn percent(part: u64, total: u64) -> f64 {
+    100.0 * part as f64 / total.max(1) as f64
+}
+
+/// Sorts counted items by their count, highest first, and keeps the top few.
+fn top<K: Ord, V: Copy + Ord>(map: HashMap<K, V>) -> Vec<(K, V)> {
+    let mut items: Vec<(K, V)> = map.into_iter().collect();
+    items.sort_by(|a, b| b.1.cmp(&a.1).then(a.0.cmp(&b.0)));
+    items.truncate(TOP);
+    items
+}
+
+/// Produces the text report for a parsed trace.
+pub fn report(trace: &Trace) -> String {
+    let mut out = String::new();
+    let instructions: u64 = trace.counts.iter().sum::<u64>() + trace.odd_pcs;
+    let cycles: u64 = trace.executed().map(|a| trace.cycles(a)).sum();
+    let seconds = |c: u64| c as f64 / (FRAME_BUDGET as f64 * 60.0);
+
+    writeln!(out, "Instructions: {}", instructions).unwrap();
+    writeln!(
+        out,
+        "Estimated cycles: {} ({:.1}s at 12MHz)",
+        cycles,
+        seconds(cycles)
+    )
+    .unwrap();
+    if trace.odd_pcs > 0 {
+        writeln!(
+            out,
+            "Warning: {} instructions ran from odd addresses, and are only counted in the instruction total",
+            trace.odd_pcs
+        )
+        .unwrap();
+    }
+    if trace.lost_edges > 0 {
+        writeln!(
+            out,
+            "Warning: {} jumps didn't fit in the edge table, so blocks and pairs are approximate",
+            trace.lost_edges
+        )
+        .unwrap();
+    }
+
+    let mut blocks = trace.blocks();
+    blocks.sort_by(|a, b| b.instructions.cmp(&a.instructions));
+    writeln!(out, "\nHottest blocks:").unwrap();
+    for b in blocks.iter().take(TOP) {
+        writeln!(
+            out,
+            "\n{:#05x}-{:#05x}: {} entries, {} instructions ({:.1}%), {} cycles ({:.1}%)",
+            b.start,
+            b.last,
+            b.entries,
+            b.instructions,
+            percent(b.instructions, instructions),
+            b.cycles,
+            percent(b.cycles, cycles)
+        )
+        .unwrap();
+        for addr in (b.start..=b.last).step_by(2) {
+            let op = trace.op(addr);
+            writeln!(
+                out,
+                "  {:#05x}  {:04X}  {:<20} {}",
+                addr,
+                op,
+                disassemble(op).unwrap_or_else(|| "invalid".to_string()),
+                trace.count(addr)
+            )
+            .unwrap();
+        }
+    }
+
+    let loops = trace.loops();
+    writeln!(out, "\nLoops:").unwrap();
+    for l in loops.iter().take(TOP) {
+        let kind = match l.kind {
+            LoopKind::Idle => ", waits on timer or keys",
+            LoopKind::Compute => ", registers only",
+            LoopKind::Other => "",
+        };
+        writeln!(
+            out,
+            "  {:#05x}-{:#05x}: {} iterations, {} instructions ({:.1}%){}",
+            l.start,
+            l.last,
+            l.iterations,
+            l.instructions,
+            percent(l.instructions, instructions),
+            kind
+        )
+        .unwrap();
+    }
+
+    let (singles, pairs) = trace.grams();
+    writeln!(out, "\nOpcodes:").unwrap();
+    for (class, (count, c)) in top(singles) {
+        writeln!(
+            out,
+            "  {:<5} {} ({:.1}%), {} cycles ({:.1}%)",
+            class,
+            count,
+            percent(count, instructions),
+            c,
+            percent(c, cycles)
+        )
+        .unwrap();
+    }
+
+    // Fusing a pair saves the fetch and dispatch of its second instruction.
+    // Pairs overlap, so their savings can't simply be added up.
+    let pairs = top(pairs);
+    let fused = |count: u64| count * STEP_CYCLES as u64;
+    writeln!(out, "\nOpcode pairs:").unwrap();
+    for ((a, b), count) in &pairs {
+        writeln!(
+            out,
+            "  {:<5} {:<5} {} ({:.1}%), fusing saves {} cycles",
+            a,
+            b,
+            count,
+            percent(*count, instructions),
+            fused(*count)
+        )
+        .unwrap();
+    }
+    let fusion = pairs.first().map_or(0, |(_, count)| fused(*count));
+
+    // Nested loops are already part of the loop around them.
+    let savings = |kind: LoopKind| -> u64 {
+        loops
+            .iter()
+            .filter(|l| l.kind == kind)
+            .filter(|l| !loops.iter().any(|o| o.kind == kind && o.contains(l)))
+            .map(|l| l.repeat_cycles(trace.count(l.start)))
+            .sum()
+    };
+    let idle = savings(LoopKind::Idle);
+    let compute = savings(LoopKind::Compute);
+
+    writeln!(out, "\nEstimated savings:").unwrap();
+    for (name, saved) in [
+        ("Fusing the most common pair", fusion),
+        ("Skipping idle loops", idle),
+        ("Fast-forwarding register loops", compute),
+    ] {
+        writeln!(
+            out,
+            "  {}: {} cycles ({:.1}%, {:.1}s)",
+            name,
+            saved,
+            percent(saved, cycles),
+            seconds(saved)
+        )
+        .unwrap();
+    }
+
+    out
+}
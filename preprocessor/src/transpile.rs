@@ -0,0 +1,364 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Translates the statically discovered code of a ROM into C, so that a host
+//! can run it natively.
+//!
+//! Every block becomes a function that takes the CPU state and returns the
+//! address to continue from, with the registers it uses held in locals. Only
+//! instructions that touch nothing but the registers, memory and the stack
+//! are translated. Anything else, such as drawing, keys, timers or rand, ends
+//! the function at that instruction, and the host interprets it before
+//! looking up the function for the next address. The same goes for any
+//! address without a function, which covers code only reached through Bnnn.
+//! Stores that hit translated code set code_dirty, after which the host has
+//! to interpret everything.
+//!
+//! The semantics follow the handlers in opcodes.c, quirks included.
+
+use std::fmt::Write;
+
+use crate::report::{block_ranges, disassemble, load, n, opcode, x, y};
+
+const PRELUDE: &str = "\
+#include <stdint.h>
+
+struct ch8_cpu {
+	uint8_t memory[0x1000];
+	uint8_t v[16];
+	uint16_t i;
+	uint16_t stack[16];
+	uint8_t sp;
+	uint8_t code_dirty;
+};
+
+typedef uint16_t (*ch8_block_fn)(struct ch8_cpu *c);
+
+// Returns to the host, which has to interpret the instruction at addr.
+#define BAIL(addr) do { next = (addr); goto out; } while (0)
+
+#define MEM(addr) c->memory[(addr) & 0xFFF]
+";
+
+/// Registers a function reads or writes, as masks of V0-VF.
+#[derive(Default)]
+struct Regs {
+    used: u16,
+    written: u16,
+}
+
+impl Regs {
+    fn r(&mut self, reg: u16) -> String {
+        self.used |= 1 << reg;
+        format!("v{:X}", reg)
+    }
+
+    fn w(&mut self, reg: u16) -> String {
+        self.written |= 1 << reg;
+        self.r(reg)
+    }
+}
+
+/// Checks a store of len bytes at `at` against the translated code, which
+/// spans code.0 up to but not including code.1.
+fn code_check(at: &str, len: u16, addr: u16, code: (u16, u16)) -> String {
+    format!(
+        "\tif ({at} < {:#05x} && {at} + {len} > {:#05x}) {{\n\
+         \t\tc->code_dirty = 1;\n\
+         \t\tBAIL({:#05x});\n\
+         \t}}\n",
+        code.1,
+        code.0,
+        addr + 2,
+    )
+}
+
+/// Ends a function on a skip.
+fn skip(cond: String, addr: u16) -> String {
+    format!(
+        "\tnext = {} ? {:#05x} : {:#05x};\n\tgoto out;\n",
+        cond,
+        addr + 4,
+        addr + 2
+    )
+}
+
+/// The C for one instruction, and whether it ends the function. None if the
+/// host has to interpret it.
+fn translate(op: u16, addr: u16, code: (u16, u16), regs: &mut Regs) -> Option<(String, bool)> {
+    let (x, y, nn, nnn) = (x(op), y(op), op & 0xFF, op & 0xFFF);
+    let next = addr + 2;
+    let mut out = String::new();
+
+    match op >> 12 {
+        0x0 if op == 0x00EE => {
+            write!(
+                out,
+                "\tif (!c->sp)\n\t\tBAIL({:#05x});\n\tnext = c->stack[--c->sp];\n\tgoto out;\n",
+                addr
+            )
+            .unwrap();
+            return Some((out, true));
+        }
+        0x1 => return Some((format!("\tnext = {:#05x};\n\tgoto out;\n", nnn), true)),
+        0x2 => {
+            write!(
+                out,
+                "\tif (c->sp == 16)\n\t\tBAIL({:#05x});\n\
+                 \tc->stack[c->sp++] = {:#05x};\n\tnext = {:#05x};\n\tgoto out;\n",
+                addr, next, nnn
+            )
+            .unwrap();
+            return Some((out, true));
+        }
+        0x3 => {
+            let c = format!("{} == {:#04x}", regs.r(x), nn);
+            return Some((skip(c, addr), true));
+        }
+        0x4 => {
+            let c = format!("{} != {:#04x}", regs.r(x), nn);
+            return Some((skip(c, addr), true));
+        }
+        0x5 if n(op) == 0 => {
+            let c = format!("{} == {}", regs.r(x), regs.r(y));
+            return Some((skip(c, addr), true));
+        }
+        0x9 if n(op) == 0 => {
+            let c = format!("{} != {}", regs.r(x), regs.r(y));
+            return Some((skip(c, addr), true));
+        }
+        0x5 if n(op) == 2 => {
+            for r in x..=y {
+                writeln!(out, "\tMEM(i + {}) = {};", r, regs.r(r)).unwrap();
+            }
+            if x <= y {
+                out.push_str(&code_check(&format!("i + {}", x), y - x + 1, addr, code));
+            }
+        }
+        0x5 if n(op) == 3 => {
+            for r in x..=y {
+                writeln!(out, "\t{} = MEM(i + {});", regs.w(r), r).unwrap();
+            }
+        }
+        0x6 => writeln!(out, "\t{} = {:#04x};", regs.w(x), nn).unwrap(),
+        0x7 => writeln!(out, "\t{} += {:#04x};", regs.w(x), nn).unwrap(),
+        0x8 => {
+            let (vx, vy) = (regs.w(x), regs.r(y));
+            let vf = if matches!(n(op), 0x4..=0x7 | 0xE) {
+                regs.w(0xF)
+            } else {
+                String::new()
+            };
+            match n(op) {
+                0x0 => writeln!(out, "\t{} = {};", vx, vy),
+                0x1 => writeln!(out, "\t{} |= {};", vx, vy),
+                0x2 => writeln!(out, "\t{} &= {};", vx, vy),
+                0x3 => writeln!(out, "\t{} ^= {};", vx, vy),
+                0x4 => writeln!(
+                    out,
+                    "\t{{\n\t\tunsigned t = {} + {};\n\t\t{} = t;\n\t\t{} = t > 0xFF;\n\t}}",
+                    vx, vy, vx, vf
+                ),
+                0x5 => writeln!(
+                    out,
+                    "\t{{\n\t\tuint8_t x = {}, y = {};\n\t\t{} = x - y;\n\t\t{} = y <= x;\n\t}}",
+                    vx, vy, vx, vf
+                ),
+                0x6 => writeln!(
+                    out,
+                    "\t{{\n\t\tuint8_t y = {};\n\t\t{} = y >> 1;\n\t\t{} = y & 1;\n\t}}",
+                    vy, vx, vf
+                ),
+                0x7 => writeln!(
+                    out,
+                    "\t{{\n\t\tuint8_t x = {}, y = {};\n\t\t{} = y - x;\n\t\t{} = x <= y;\n\t}}",
+                    vx, vy, vx, vf
+                ),
+                0xE => writeln!(
+                    out,
+                    "\t{{\n\t\tuint8_t y = {};\n\t\t{} = y << 1;\n\t\t{} = y >> 7;\n\t}}",
+                    vy, vx, vf
+                ),
+                _ => return None,
+            }
+            .unwrap();
+        }
+        0xA => writeln!(out, "\ti = {:#05x};", nnn).unwrap(),
+        0xB => {
+            let v0 = regs.r(0);
+            return Some((
+                format!("\tnext = ({:#05x} + {}) & 0xFFF;\n\tgoto out;\n", nnn, v0),
+                true,
+            ));
+        }
+        0xF => match nn {
+            0x1E => {
+                let vx = regs.r(x);
+                write!(
+                    out,
+                    "\ti += {};\n\t{} = i > 0xFFF;\n\ti &= 0xFFF;\n",
+                    vx,
+                    regs.w(0xF)
+                )
+                .unwrap();
+            }
+            0x29 | 0x30 => {
+                let vx = regs.r(x);
+                let addr_of = if nn == 0x29 {
+                    format!("{} * 5", vx)
+                } else {
+                    format!("{} * 10 + 80", vx)
+                };
+                write!(
+                    out,
+                    "\tif ({} > 0xF)\n\t\tBAIL({:#05x});\n\ti = {};\n",
+                    vx, addr, addr_of
+                )
+                .unwrap();
+            }
+            0x33 => {
+                write!(
+                    out,
+                    "\tMEM(i + 2) = {vx} % 10;\n\tMEM(i + 1) = {vx} / 10 % 10;\n\tMEM(i) = {vx} / 100;\n",
+                    vx = regs.r(x)
+                )
+                .unwrap();
+                out.push_str(&code_check("i", 3, addr, code));
+            }
+            0x55 => {
+                out.push_str("\t{\n\t\tuint16_t at = i;\n\n");
+                for r in 0..=x {
+                    writeln!(out, "\t\tMEM(at + {}) = {};", r, regs.r(r)).unwrap();
+                }
+                writeln!(out, "\t\ti = (i + {}) & 0xFFF;", x + 1).unwrap();
+                for line in code_check("at", x + 1, addr, code).lines() {
+                    writeln!(out, "\t{}", line).unwrap();
+                }
+                out.push_str("\t}\n");
+            }
+            0x65 => {
+                for r in 0..=x {
+                    writeln!(out, "\t{} = MEM(i + {});", regs.w(r), r).unwrap();
+                }
+                writeln!(out, "\ti = (i + {}) & 0xFFF;", x + 1).unwrap();
+            }
+            _ => return None,
+        },
+        _ => return None,
+    }
+
+    Some((out, false))
+}
+
+/// Emits one function starting at `start`, stopping after `last` or at the
+/// first instruction the host has to interpret. Returns the function, if the
+/// first instruction could be translated, and where the next one starts.
+fn function(memory: &[u8], start: u16, last: u16, code: (u16, u16)) -> (Option<String>, u16) {
+    let mut regs = Regs::default();
+    let mut body = String::new();
+    let mut addr = start;
+
+    let end = loop {
+        let op = opcode(memory, addr);
+
+        match translate(op, addr, code, &mut regs) {
+            Some((text, ends)) => {
+                writeln!(
+                    body,
+                    "\t// {:#05x}: {}",
+                    addr,
+                    disassemble(op).unwrap_or_default()
+                )
+                .unwrap();
+                body.push_str(&text);
+                if ends {
+                    break addr + 2;
+                }
+            }
+            None => {
+                if addr == start {
+                    return (None, addr + 2);
+                }
+                writeln!(body, "\tBAIL({:#05x});", addr).unwrap();
+                break addr + 2;
+            }
+        }
+
+        if addr == last {
+            writeln!(body, "\tnext = {:#05x};\n\tgoto out;", addr + 2).unwrap();
+            break addr + 2;
+        }
+        addr += 2;
+    };
+
+    let mut f = String::new();
+    writeln!(
+        f,
+        "static uint16_t block_{:03x}(struct ch8_cpu *c)\n{{",
+        start
+    )
+    .unwrap();
+    for r in (0..16).filter(|r| regs.used >> r & 1 == 1) {
+        writeln!(f, "\tuint8_t v{:X} = c->v[{}];", r, r).unwrap();
+    }
+    f.push_str("\tuint16_t i = c->i;\n\tuint16_t next;\n\n");
+    f.push_str(&body);
+    f.push_str("out:\n");
+    for r in (0..16).filter(|r| regs.written >> r & 1 == 1) {
+        writeln!(f, "\tc->v[{}] = v{:X};", r, r).unwrap();
+    }
+    f.push_str("\tc->i = i;\n\treturn next;\n}\n");
+
+    (Some(f), end)
+}
+
+/// Produces C source for a raw ROM image. The host looks up the function for
+/// an address in ch8_blocks[addr / 2].
+pub fn transpile(rom: &[u8]) -> String {
+    let memory = load(rom);
+    let ranges = block_ranges(&memory);
+    let mut out = String::new();
+    let mut starts = Vec::new();
+
+    let code = (
+        ranges.iter().map(|r| r.0).min().unwrap_or(0),
+        ranges.iter().map(|r| r.1 + 2).max().unwrap_or(0),
+    );
+
+    out.push_str("// Generated by ch8ti-prep --transpile.\n\n");
+    out.push_str(PRELUDE);
+
+    for &(start, last) in &ranges {
+        let mut addr = start;
+        while addr <= last {
+            let (f, next) = function(&memory, addr, last, code);
+            if let Some(f) = f {
+                out.push('\n');
+                out.push_str(&f);
+                starts.push(addr);
+            }
+            addr = next;
+        }
+    }
+
+    out.push_str("\nconst ch8_block_fn ch8_blocks[0x1000 / 2] = {\n");
+    for s in starts {
+        writeln!(out, "\t[{:#05x} / 2] = block_{:03x},", s, s).unwrap();
+    }
+    out.push_str("};\n");
+
+    out
+}
@@ -0,0 +1,570 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chip8.h"
+#include <alloc.h>
+#include <error.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vat.h>
+
+/*
+ * Replays are recorded in virtual time, where a run only depends on the state
+ * it starts from and on the keys held during each frame. So a replay is the
+ * key masks of every frame, plus a compressed keyframe of the whole state
+ * every REPLAY_INTERVAL frames. Playback can then start from any keyframe by
+ * restoring it and playing the key masks that follow.
+ *
+ * Keyframes double as checkpoints when verifying a replay. Each segment is
+ * simulated from its own keyframe and has to end on the next one. Within a
+ * segment, the frame hash is recorded every REPLAY_HASH_INTERVAL frames, so
+ * a mismatch is narrowed down to the second it happened in.
+ *
+ * A c8rp variable holds:
+ *   struct ch8_replay_header
+ *   one segment per keyframe, each made of
+ *     uint16_t length of the compressed state
+ *     the compressed struct ch8_state, padded to an even length
+ *     runs of a uint16_t key mask followed by a uint16_t frame count,
+ *     covering the frames up to the next keyframe. A count of 0 marks a
+ *     frame hash taken before the frames of the next run instead.
+ *   uint16_t offsets of the segments, from the start of the header
+ *   C8RP_TAG
+ */
+
+// 20 seconds at 60hz.
+#define REPLAY_INTERVAL 1200
+#define REPLAY_HASH_INTERVAL 60
+#define REPLAY_MAX_KEYFRAMES 64
+// Leaves room below the largest variable size for the index and the tag.
+#define REPLAY_MAX_SIZE (65000 - 2 * REPLAY_MAX_KEYFRAMES)
+#define REPLAY_GROW 1024
+
+struct ch8_replay_header {
+	struct ch8_version version;
+	uint16_t tick_period;
+	uint16_t interval;
+	uint16_t frames;
+	uint16_t keyframes;
+	uint16_t index;
+};
+
+enum replay_mode {
+	REPLAY_OFF,
+	REPLAY_RECORD,
+	REPLAY_PLAY,
+	REPLAY_LIVE, // Keys are still read once per frame, but not recorded.
+};
+
+static const char C8RP_TAG[] = { 0, 'c', '8', 'r', 'p', 0, OTH_TAG };
+
+_Bool ch8_replay_on = FALSE;
+uint16_t ch8_replay_keys = 0;
+uint16_t ch8_replay_edges = 0;
+uint16_t ch8_replay_diverged = 0;
+
+static enum replay_mode mode = REPLAY_OFF;
+static HANDLE handle = H_NULL;
+static const char *record_name = NULL;
+static struct ch8_state *checkpoint = NULL;
+
+static uint16_t interval;
+static uint16_t frame;
+static uint16_t frames;
+static uint16_t keyframes;
+static uint16_t index_offset;
+
+// The key run of the current frame.
+static uint16_t run;
+static uint16_t run_left;
+
+// Only used while recording.
+static uint16_t used;
+static uint16_t capacity;
+static uint16_t keyframe_at[REPLAY_MAX_KEYFRAMES];
+
+static inline uint8_t *replay_data(void)
+{
+	return ((MULTI_EXPR *)HeapDeref(handle))->Expr;
+}
+
+static inline uint16_t read16(const uint8_t *data, uint16_t offset)
+{
+	return *(const uint16_t *)(data + offset);
+}
+
+static inline uint16_t segment_at(const uint8_t *data, uint16_t k)
+{
+	return read16(data, index_offset + 2 * k);
+}
+
+// Returns the offset of the first key run of a segment.
+static uint16_t segment_keys(const uint8_t *data, uint16_t segment)
+{
+	uint16_t len = read16(data, segment);
+
+	return segment + 2 + len + (len & 1);
+}
+
+static void check_hash(uint16_t hash)
+{
+	if (checkpoint && !ch8_replay_diverged && ch8_frame_hash() != hash)
+		ch8_replay_diverged = frame;
+}
+
+/*
+ * Returns the recorded keys of the current frame. Frames have to be played in
+ * order, starting from a keyframe.
+ */
+static uint16_t stored_keys(void)
+{
+	const uint8_t *data = replay_data();
+
+	if (frame % interval == 0) {
+		run = segment_keys(data, segment_at(data, frame / interval));
+		run_left = read16(data, run + 2);
+	} else if (!--run_left) {
+		do {
+			run += 4;
+			run_left = read16(data, run + 2);
+			if (!run_left)
+				check_hash(read16(data, run));
+		} while (!run_left);
+	}
+
+	return read16(data, run);
+}
+
+/*
+ * Makes room for len more bytes in the recording.
+ *
+ * Safety: can trigger heap compression.
+ */
+static _Bool reserve(uint16_t len)
+{
+	uint32_t needed = (uint32_t)used + len;
+	HANDLE resized;
+
+	if (needed > REPLAY_MAX_SIZE)
+		return FALSE;
+
+	if (needed <= capacity)
+		return TRUE;
+
+	needed += REPLAY_GROW;
+	if (needed > REPLAY_MAX_SIZE)
+		needed = REPLAY_MAX_SIZE;
+
+	if (!(resized = HeapRealloc(handle, 2 + needed)))
+		return FALSE;
+
+	handle = resized;
+	capacity = needed;
+	return TRUE;
+}
+
+static _Bool record_keyframe(struct ch8_state *state)
+{
+	uint8_t *segment;
+	uint16_t len;
+
+	// The compressor can double the size of its input at worst.
+	if (keyframes == REPLAY_MAX_KEYFRAMES ||
+	    !reserve(2 + 2 * sizeof(*state)))
+		return FALSE;
+
+	save_chip8_screen(state->display);
+	state->randstate = __randseed;
+
+	segment = replay_data() + used;
+	len = ch8_compress(segment + 2, (const uint8_t *)state, sizeof(*state));
+	*(uint16_t *)segment = len;
+
+	keyframe_at[keyframes++] = used;
+	used += 2 + len + (len & 1);
+	return TRUE;
+}
+
+static void record_frame(struct ch8_state *state, uint16_t keys)
+{
+	uint16_t *last;
+
+	// Frame numbers are 16 bits, which is about 18 minutes at 60hz.
+	if (frames == UINT16_MAX)
+		goto full;
+
+	if (frame % interval == 0) {
+		if (!record_keyframe(state))
+			goto full;
+		run = 0;
+	} else if (frame % REPLAY_HASH_INTERVAL == 0) {
+		if (!reserve(4))
+			goto full;
+
+		last = (uint16_t *)(replay_data() + used);
+		last[0] = ch8_frame_hash();
+		last[1] = 0;
+		used += 4;
+		run = 0;
+	}
+
+	last = (uint16_t *)(replay_data() + run);
+
+	if (run && last[0] == keys && last[1] != UINT16_MAX) {
+		last[1]++;
+	} else {
+		if (!reserve(4))
+			goto full;
+
+		last = (uint16_t *)(replay_data() + used);
+		last[0] = keys;
+		last[1] = 1;
+		run = used;
+		used += 4;
+	}
+
+	frames++;
+	return;
+full:
+	mode = REPLAY_LIVE;
+}
+
+// Samples (or replays) the keys for the frame that is starting.
+static void start_frame(struct ch8_state *state)
+{
+	uint16_t keys;
+
+	if (mode == REPLAY_PLAY && frame < frames) {
+		keys = stored_keys();
+	} else {
+		keys = ch8_read_keys();
+		if (mode == REPLAY_RECORD)
+			record_frame(state, keys);
+	}
+
+	ch8_replay_edges = ch8_replay_keys & ~keys;
+	ch8_replay_keys = keys;
+}
+
+_Bool ch8_is_replay(const MULTI_EXPR *data)
+{
+	return data->Size >= sizeof(C8RP_TAG) &&
+	       !memcmp(data->Expr + data->Size - sizeof(C8RP_TAG), C8RP_TAG,
+		       sizeof(C8RP_TAG));
+}
+
+/*
+ * Starts recording a run into a new variable called name. Replays are only
+ * reproducible in virtual time, so tick_period must not be 0.
+ *
+ * Safety: can trigger heap compression.
+ */
+enum ch8_error ch8_replay_record(const char *name, uint16_t tick_period)
+{
+	struct ch8_replay_header *header;
+
+	// Never overwrite anything, as it could be the rom being recorded.
+	if (!tick_period || SymFind(SYMSTR(name)).folder != 0)
+		return E_INVALID_ARGUMENT;
+
+	capacity = sizeof(*header) + REPLAY_GROW;
+	if (!(handle = HeapAlloc(2 + capacity)))
+		return E_OOM;
+
+	header = (struct ch8_replay_header *)replay_data();
+	header->version = (struct ch8_version){ MAJOR_VERSION, MINOR_VERSION,
+						PATCH_VERSION };
+	header->tick_period = tick_period;
+	header->interval = REPLAY_INTERVAL;
+
+	used = sizeof(*header);
+	interval = REPLAY_INTERVAL;
+	frame = frames = keyframes = 0;
+	record_name = name;
+	mode = REPLAY_RECORD;
+	return E_OK;
+}
+
+/*
+ * Checks that the segments of a replay are in order between the header and
+ * the index, at even offsets, and that their key runs cover the frames played
+ * from them, as stored_keys() and load_keyframe() trust all of it.
+ */
+static _Bool check_segments(const uint8_t *data)
+{
+	uint32_t end, run, covered, needed;
+	uint16_t k, segment;
+
+	if (index_offset & 1 || index_offset < sizeof(struct ch8_replay_header) ||
+	    frames > (uint32_t)keyframes * interval)
+		return FALSE;
+
+	for (k = 0; k < keyframes; k++) {
+		segment = segment_at(data, k);
+		end = k + 1 < keyframes ? segment_at(data, k + 1) : index_offset;
+		if (segment & 1 || segment < sizeof(struct ch8_replay_header) ||
+		    end > index_offset || (uint32_t)segment + 2 > end)
+			return FALSE;
+
+		// The first run is read whatever its count, so it can't be a hash.
+		run = (uint32_t)segment + 2 + read16(data, segment) +
+		      (read16(data, segment) & 1);
+		if (run + 4 > end || !(covered = read16(data, run + 2)))
+			return FALSE;
+
+		needed = frames > (uint32_t)k * interval ?
+				 frames - (uint32_t)k * interval :
+				 0;
+		if (needed > interval)
+			needed = interval;
+		while (covered < needed) {
+			run += 4;
+			if (run + 4 > end)
+				return FALSE;
+			covered += read16(data, run + 2);
+		}
+	}
+
+	return TRUE;
+}
+
+static enum ch8_error load_keyframe(uint16_t k, struct ch8_state *state)
+{
+	const uint8_t *data = replay_data();
+	uint16_t segment = segment_at(data, k);
+
+	if (ch8_decompress_n((uint8_t *)state, sizeof(*state),
+			     data + segment + 2,
+			     read16(data, segment)) != sizeof(*state))
+		return E_ROM_LOAD;
+
+	if (state->version.major != MAJOR_VERSION ||
+	    state->version.minor > MINOR_VERSION)
+		return E_VERSION;
+
+	return E_OK;
+}
+
+/*
+ * Loads the keyframe at or before frame seek from a replay, and sets up the
+ * rest of the replay to be played from there. The replay's tick period is
+ * returned through tick_period.
+ *
+ * If verify is set, the whole replay is checked against its keyframes
+ * instead. See ch8_replay_check().
+ *
+ * Safety: can trigger heap compression.
+ */
+enum ch8_error ch8_replay_play(HSym sym, struct ch8_state *state,
+			       uint16_t seek, uint16_t *tick_period,
+			       _Bool verify)
+{
+	const struct ch8_replay_header *header;
+	const MULTI_EXPR *file;
+	enum ch8_error result;
+	uint16_t k;
+
+	handle = DerefSym(sym)->handle;
+	file = HeapDeref(handle);
+	header = (const struct ch8_replay_header *)file->Expr;
+
+	if (file->Size < sizeof(*header) + sizeof(C8RP_TAG) ||
+	    header->version.major != MAJOR_VERSION ||
+	    header->version.minor > MINOR_VERSION)
+		return E_VERSION;
+
+	if (!header->interval || !header->keyframes || !header->tick_period ||
+	    header->index + 2 * header->keyframes + sizeof(C8RP_TAG) !=
+		    file->Size)
+		return E_ROM_LOAD;
+
+	interval = header->interval;
+	frames = header->frames;
+	keyframes = header->keyframes;
+	index_offset = header->index;
+
+	if (!check_segments(file->Expr))
+		return E_ROM_LOAD;
+
+	k = seek / interval;
+	if (k >= keyframes)
+		k = keyframes - 1;
+
+	if ((result = load_keyframe(k, state)) != E_OK)
+		return result;
+
+	if (verify && !(checkpoint = malloc(sizeof(*checkpoint))))
+		return E_OOM;
+
+	srand(state->randstate);
+	state->from_state = TRUE;
+
+	*tick_period = header->tick_period;
+	frame = k * interval;
+	ch8_replay_diverged = 0;
+
+	HLock(handle);
+	mode = REPLAY_PLAY;
+	return E_OK;
+}
+
+/*
+ * Called by ch8_run() before the first instruction. Recordings take their
+ * first keyframe here, where the screen has been set up.
+ */
+void ch8_replay_begin(struct ch8_state *state)
+{
+	if (mode == REPLAY_OFF)
+		return;
+
+	ch8_replay_on = TRUE;
+
+	/*
+	 * Fx0A may be waiting on a key that was released on this frame, so the
+	 * keys of the frame before are needed. They are in the last run of the
+	 * segment before.
+	 */
+	if (mode == REPLAY_PLAY && frame && frame <= frames)
+		ch8_replay_keys = read16(replay_data(),
+					 segment_at(replay_data(),
+						    frame / interval) - 4);
+	else
+		ch8_replay_keys = 0;
+
+	start_frame(state);
+}
+
+// Called by ch8_run() after the timers tick.
+void ch8_replay_frame(struct ch8_state *state)
+{
+	if (mode == REPLAY_OFF)
+		return;
+
+	if (frame != UINT16_MAX)
+		frame++;
+
+	if (checkpoint && (frame % interval == 0 || frame == frames))
+		ER_throw(E_CHECKPOINT);
+
+	start_frame(state);
+}
+
+/*
+ * Called when verification has simulated a segment of the replay. Compares
+ * the state against the next keyframe, and sets up the next segment from it.
+ * Returns E_OK while there are segments left, then either E_REPLAY_VERIFIED
+ * or E_REPLAY_DIVERGED. ch8_replay_diverged is set to the first frame that
+ * didn't match.
+ */
+enum ch8_error ch8_replay_check(struct ch8_state *state)
+{
+	uint16_t k = frame / interval;
+	enum ch8_error result;
+
+	if (frame % interval == 0 && k < keyframes) {
+		if ((result = load_keyframe(k, checkpoint)) != E_OK)
+			return result;
+
+		// Same as what record_keyframe() compressed.
+		save_chip8_screen(state->display);
+		state->randstate = __randseed;
+		checkpoint->from_state = state->from_state;
+
+		if (memcmp(state, checkpoint, sizeof(*state)) &&
+		    !ch8_replay_diverged)
+			ch8_replay_diverged = frame;
+	} else {
+		k = keyframes;
+	}
+
+	if (frame >= frames || k >= keyframes)
+		return ch8_replay_diverged ? E_REPLAY_DIVERGED :
+					     E_REPLAY_VERIFIED;
+
+	// Each segment starts from its own keyframe, even after a mismatch.
+	*state = *checkpoint;
+	srand(state->randstate);
+	restore_chip8_screen(state->display);
+	return E_OK;
+}
+
+static enum ch8_error write_recording(void)
+{
+	struct ch8_replay_header *header;
+	MULTI_EXPR *file;
+	uint16_t size;
+	HANDLE resized;
+	HSym hsym;
+
+	if (!keyframes) {
+		HeapFree(handle);
+		return E_OK;
+	}
+
+	size = used + 2 * keyframes + sizeof(C8RP_TAG);
+
+	if (!(resized = HeapRealloc(handle, 2 + size))) {
+		HeapFree(handle);
+		return E_OOM;
+	}
+	handle = resized;
+
+	file = HeapDeref(handle);
+	file->Size = size;
+
+	header = (struct ch8_replay_header *)file->Expr;
+	header->frames = frames;
+	header->keyframes = keyframes;
+	header->index = used;
+
+	memcpy(file->Expr + used, keyframe_at, 2 * keyframes);
+	memcpy(file->Expr + used + 2 * keyframes, C8RP_TAG, sizeof(C8RP_TAG));
+
+	hsym = SymAdd(SYMSTR(record_name));
+	if (hsym.folder == 0) {
+		HeapFree(handle);
+		return E_OOM;
+	}
+
+	DerefSym(hsym)->handle = handle;
+	return E_OK;
+}
+
+/*
+ * Ends the replay, if there is one. A recording is written out to its
+ * variable.
+ *
+ * Safety: can trigger heap compression.
+ */
+enum ch8_error ch8_replay_finish(void)
+{
+	enum ch8_error result = E_OK;
+
+	if (record_name)
+		result = write_recording();
+	else if (mode == REPLAY_PLAY)
+		HeapUnlock(handle);
+
+	free(checkpoint);
+	checkpoint = NULL;
+
+	ch8_replay_on = FALSE;
+	mode = REPLAY_OFF;
+	handle = H_NULL;
+	record_name = NULL;
+	return result;
+}
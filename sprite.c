@@ -18,8 +18,58 @@
 #include <compat.h>
 #include <gray.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+enum draw_mode {
+	DRAW_XOR, // Draw the sprite and report collisions.
+	DRAW_TEST, // Only report collisions.
+	DRAW_TEST_INVERTED, // Report collisions as if the sprite was drawn twice.
+};
+
+/*
+ * Sprites normally wrap around the edges of the screen. When this is set,
+ * only their position wraps, and anything past the right or bottom edge is
+ * clipped instead, as S-CHIP roms expect.
+ */
+_Bool ch8_clip_sprites = FALSE;
+
+// Each bit doubled, for stretching lo-res sprites to hi-res.
+static const uint8_t DOUBLED_NIBBLES[16] = {
+	0x00, 0x03, 0x0C, 0x0F, 0x30, 0x33, 0x3C, 0x3F,
+	0xC0, 0xC3, 0xCC, 0xCF, 0xF0, 0xF3, 0xFC, 0xFF,
+};
+
+static inline uint16_t double_bits(uint8_t byte)
+{
+	return DOUBLED_NIBBLES[byte >> 4] << 8 | DOUBLED_NIBBLES[byte & 0xF];
+}
+
+/*
+ * The frame hash summarizes both planes of the window without reading all of
+ * them every time. Each row keeps a hash that is only recomputed after the row
+ * is drawn to, and the frame hash is the sum of the row hashes, so it is
+ * updated one changed row at a time. See ch8_frame_hash().
+ */
+static uint32_t dirty_rows[2] = { UINT32_MAX, UINT32_MAX };
+static uint16_t row_hashes[64];
+static uint16_t frame_hash;
+
+static void mark_rows(uint8_t y, uint8_t n)
+{
+	for (uint8_t i = 0; i < n; i++) {
+		uint8_t row = (y + i) % 64;
+
+		dirty_rows[row / 32] |= 1UL << (row % 32);
+	}
+}
+
+static inline void mark_all_rows(void)
+{
+	dirty_rows[0] = UINT32_MAX;
+	dirty_rows[1] = UINT32_MAX;
+}
+
 /*
  * The actual implementation of draw_sprite_16_hi. It is wrapped to abstract
  * plane selection and switching.
@@ -27,7 +77,7 @@
  * See the wrapper for a better description of the function.
  */
 static _Bool _draw_sprite_16_hi(const uint16_t *sprite16, uint8_t x, uint8_t y,
-				uint8_t n, void *display)
+				uint8_t n, void *display, enum draw_mode mode)
 {
 	const uint8_t *sprite = (uint8_t *)sprite16;
 	uint16_t mask = UINT16_MAX;
@@ -40,6 +90,10 @@ static _Bool _draw_sprite_16_hi(const uint16_t *sprite16, uint8_t x, uint8_t y,
 	x %= 128;
 	y %= 64;
 
+	// Rows past the bottom edge are never touched.
+	if (ch8_clip_sprites && n > 64 - y)
+		n = 64 - y;
+
 	x += X_BASE;
 
 	shft = 16 - (x % 16);
@@ -47,32 +101,199 @@ static _Bool _draw_sprite_16_hi(const uint16_t *sprite16, uint8_t x, uint8_t y,
 	if (x >= 128 + X_BASE - 16) {
 		mask = UINT32_MAX << (uint32_t)(x % 16);
 
-		// Recurse to draw the overshoot. Can only happen once per call.
-		uint16_t left_sprite[n];
-		for (short i = 0; i < n; i++) {
-			left_sprite[i] = (sprite[2 * i] << 8) |
-					 sprite[2 * i + 1];
-			left_sprite[i] = (left_sprite[i] & ~mask) << shft;
+		// Recurse to draw the overshoot, unless it's clipped. Can only
+		// happen once per call.
+		if (!ch8_clip_sprites) {
+			uint16_t left_sprite[n];
+			for (short i = 0; i < n; i++) {
+				left_sprite[i] = (sprite[2 * i] << 8) |
+						 sprite[2 * i + 1];
+				left_sprite[i] = (left_sprite[i] & ~mask)
+						 << shft;
+			}
+
+			ret = _draw_sprite_16_hi(left_sprite, 0, y, n, display,
+						 mode);
 		}
-
-		ret = _draw_sprite_16_hi(left_sprite, 0, y, n, display);
 	}
 
 	for (short i = 0; i < n; i++) {
+		data = ((sprite[2 * i] << 8) | sprite[2 * i + 1]);
+		data &= mask;
+
+		// Blank rows can neither change the planes nor collide.
+		if (!data)
+			continue;
+
+		data <<= shft;
 		ptr = display;
 		ptr += ((y + i) % 64 + Y_BASE) * 30;
 		ptr += x / 8 & ~1;
 		line = *(uint32_t *)ptr;
-		data = ((sprite[2 * i] << 8) | sprite[2 * i + 1]);
-		data &= mask;
-		data <<= shft;
-		ret |= data & line;
-		*(uint32_t *)ptr = line ^ data;
+		if (mode == DRAW_TEST_INVERTED)
+			ret |= data & ~line;
+		else
+			ret |= data & line;
+		if (mode == DRAW_XOR)
+			*(uint32_t *)ptr = line ^ data;
 	}
 
 	return ret;
 }
 
+// Wrapped by draw_sprite_16_hi() and the deferred draw list.
+static _Bool draw_planes(enum ch8_plane planes, const uint16_t *sprite16,
+			 uint8_t x, uint8_t y, uint8_t n, enum draw_mode mode)
+{
+	_Bool ret = FALSE;
+
+	if (mode == DRAW_XOR)
+		mark_rows(y, n);
+
+	if (planes & C8_PLANE_LIGHT)
+		ret |= _draw_sprite_16_hi(sprite16, x, y, n,
+					  GrayGetPlane(LIGHT_PLANE), mode);
+	if (planes & C8_PLANE_DARK)
+		ret |= _draw_sprite_16_hi(sprite16, x, y, n,
+					  GrayGetPlane(DARK_PLANE), mode);
+
+	return ret;
+}
+
+/*
+ * Games move objects by drawing a sprite over itself to erase it and drawing it
+ * again somewhere else, often many times between two frames. Instead of XORing
+ * every sprite into the planes immediately, draws are queued until the next
+ * timer tick. Collisions are still reported immediately by testing against the
+ * planes, which is only valid while queued draws don't overlap each other. A
+ * draw that exactly repeats a queued draw cancels it out.
+ */
+
+#define DRAW_LIST_LEN 8
+#define DRAW_MAX_ROWS 32
+
+struct pending_draw {
+	enum ch8_plane planes;
+	uint8_t x, y, n;
+	uint16_t sprite[DRAW_MAX_ROWS];
+};
+
+// Draws are never deferred when this is NULL.
+static struct pending_draw *draw_list;
+static uint8_t draw_count;
+
+// Whether two ranges overlap on a circle of len (a power of two) entries.
+static inline _Bool wrapped_overlap(uint8_t a, uint8_t alen, uint8_t b,
+				    uint8_t blen, uint8_t len)
+{
+	return ((b - a) & (len - 1)) < alen || ((a - b) & (len - 1)) < blen;
+}
+
+/*
+ * Writes all queued draws to the planes. Must be called before anything else
+ * reads or changes the planes.
+ */
+void ch8_draw_list_flush(void)
+{
+	struct pending_draw *e;
+	uint8_t phase;
+
+	if (!draw_count)
+		return;
+
+	ch8_trace(TRACE_DRAW_FLUSH);
+	phase = ch8_profile_enter(PROFILE_PRESENT);
+
+	for (short i = 0; i < draw_count; i++) {
+		e = &draw_list[i];
+		draw_planes(e->planes, e->sprite, e->x, e->y, e->n, DRAW_XOR);
+	}
+	draw_count = 0;
+
+	ch8_profile_enter(phase);
+}
+
+/*
+ * Called before clearing planes. Queued draws to planes that are about to be
+ * cleared are thrown away, and the rest are written.
+ */
+void ch8_draw_list_drop(enum ch8_plane planes)
+{
+	struct pending_draw *e;
+
+	if (draw_count)
+		ch8_trace(TRACE_DRAW_FLUSH);
+
+	for (short i = 0; i < draw_count; i++) {
+		e = &draw_list[i];
+		if (e->planes & ~planes)
+			draw_planes(e->planes & ~planes, e->sprite, e->x, e->y,
+				    e->n, DRAW_XOR);
+	}
+	draw_count = 0;
+}
+
+// Starts deferring draws. They are drawn immediately if this fails.
+void ch8_draw_list_new(void)
+{
+	// Whatever ran before may have changed the planes.
+	mark_all_rows();
+
+	draw_list = malloc(DRAW_LIST_LEN * sizeof(*draw_list));
+	draw_count = 0;
+}
+
+// Writes any queued draws and stops deferring draws.
+void ch8_draw_list_free(void)
+{
+	ch8_draw_list_flush();
+	free(draw_list);
+	draw_list = NULL;
+}
+
+static _Bool draw_deferred(enum ch8_plane planes, const uint16_t *sprite16,
+			   uint8_t x, uint8_t y, uint8_t n)
+{
+	struct pending_draw *e;
+	_Bool ret;
+
+	x %= 128;
+	y %= 64;
+
+	for (short i = 0; i < draw_count; i++) {
+		e = &draw_list[i];
+		if (!(e->planes & planes))
+			continue;
+
+		if (e->planes == planes && e->x == x && e->y == y &&
+		    e->n == n && !memcmp(e->sprite, sprite16, n * 2)) {
+			// Nothing else queued overlaps it, so order is irrelevant.
+			ret = draw_planes(planes, e->sprite, x, y, n,
+					  DRAW_TEST_INVERTED);
+			*e = draw_list[--draw_count];
+			return ret;
+		}
+
+		if (wrapped_overlap(e->x, 16, x, 16, 128) &&
+		    wrapped_overlap(e->y, e->n, y, n, 64)) {
+			ch8_draw_list_flush();
+			break;
+		}
+	}
+
+	if (draw_count == DRAW_LIST_LEN)
+		ch8_draw_list_flush();
+
+	e = &draw_list[draw_count++];
+	e->planes = planes;
+	e->x = x;
+	e->y = y;
+	e->n = n;
+	memcpy(e->sprite, sprite16, n * 2);
+
+	return draw_planes(planes, e->sprite, x, y, n, DRAW_TEST);
+}
+
 /*
  * The main sprite drawing code. This function works perfectly, at a fast enough
  * speed for this project.
@@ -80,22 +301,19 @@ static _Bool _draw_sprite_16_hi(const uint16_t *sprite16, uint8_t x, uint8_t y,
  * The tigcclib sprite code does not report when pixels are reset, otherwise
  * that would be a better option.
  *
- * Safety: can be called from interrupt context. Directly modifies grayscale memory.
- * Do not use when the screen is redirected.
+ * While ch8_run() is active, the draw is queued on the draw list and only
+ * reaches the planes on the next ch8_draw_list_flush().
+ *
+ * Safety: Directly modifies grayscale memory. Do not use when the screen is
+ * redirected. Only interrupt safe when draws are not being deferred.
  */
 _Bool draw_sprite_16_hi(enum ch8_plane planes, const uint16_t *sprite16,
 			uint8_t x, uint8_t y, uint8_t n)
 {
-	_Bool ret = FALSE;
-
-	if (planes & C8_PLANE_LIGHT)
-		ret |= _draw_sprite_16_hi(sprite16, x, y, n,
-					  GrayGetPlane(LIGHT_PLANE));
-	if (planes & C8_PLANE_DARK)
-		ret |= _draw_sprite_16_hi(sprite16, x, y, n,
-					  GrayGetPlane(DARK_PLANE));
+	if (draw_list && planes && n <= DRAW_MAX_ROWS)
+		return draw_deferred(planes, sprite16, x, y, n);
 
-	return ret;
+	return draw_planes(planes, sprite16, x, y, n, DRAW_XOR);
 }
 
 /*
@@ -126,45 +344,42 @@ _Bool draw_sprite_8_lo(enum ch8_plane planes, const uint8_t *sprite8, uint8_t x,
 		       uint8_t y, uint8_t n)
 {
 	uint16_t sprite16[n * 2];
-	// Fastest option to zero a vla in c99
-	for (short i = 0; i < n * 2; i++)
-		sprite16[i] = 0;
 
-	x *= 2;
-	y *= 2;
+	for (short i = 0; i < n; i++)
+		sprite16[i * 2] = sprite16[i * 2 + 1] = double_bits(sprite8[i]);
 
-	for (short i = 0; i < n; i++) {
-		uint8_t row = sprite8[i];
-		for (short j = 7; j >= 0; j--) {
-			sprite16[i * 2] |= (row & 128) >> 7 << (j * 2);
-			sprite16[i * 2] |= (row & 128) >> 7 << (j * 2 + 1);
-			sprite16[i * 2 + 1] |= (row & 128) >> 7 << (j * 2);
-			sprite16[i * 2 + 1] |= (row & 128) >> 7 << (j * 2 + 1);
-			row <<= 1;
-		}
-	}
-
-	return draw_sprite_16_hi(planes, sprite16, x, y, n * 2);
+	return draw_sprite_16_hi(planes, sprite16, x * 2, y * 2, n * 2);
 }
 
 /*
- * Basically it's a 16x16 sprite, but in lo-res, so actually 32x32
+ * Basically it's a 16x16 sprite, but in lo-res, so actually 32x32. Both halves
+ * are stretched in one pass, then drawn as two hi-res sprites.
  * 
  * Safety: See draw_sprite_16()
  */
 _Bool draw_sprite_16_lo(enum ch8_plane planes, const uint16_t *sprite16,
 			uint8_t x, uint8_t y, uint8_t n)
 {
-	uint8_t sprite8_left[n];
-	uint8_t sprite8_right[n];
+	const uint8_t *sprite = (const uint8_t *)sprite16;
+	uint16_t left[n * 2];
+	uint16_t right[n * 2];
+	_Bool ret;
 
 	for (short i = 0; i < n; i++) {
-		sprite8_left[i] = ((uint8_t *)sprite16)[i * 2];
-		sprite8_right[i] = ((uint8_t *)sprite16)[i * 2 + 1];
+		left[i * 2] = left[i * 2 + 1] = double_bits(sprite[i * 2]);
+		right[i * 2] = right[i * 2 + 1] =
+			double_bits(sprite[i * 2 + 1]);
 	}
 
-	return draw_sprite_8_lo(planes, sprite8_left, x, y, n) ||
-	       draw_sprite_8_lo(planes, sprite8_right, x + 8, y, n);
+	x = x * 2 % 128;
+	y *= 2;
+
+	// The right half is drawn even if the left one collided.
+	ret = draw_sprite_16_hi(planes, left, x, y, n * 2);
+	if (!ch8_clip_sprites || x < 128 - 16)
+		ret |= draw_sprite_16_hi(planes, right, x + 16, y, n * 2);
+
+	return ret;
 }
 
 /*
@@ -177,6 +392,8 @@ void save_chip8_screen(uint8_t *dest)
 {
 	const uint8_t row_bytes = 128 / 8;
 
+	ch8_draw_list_flush();
+
 	// Light plane
 	for (short i = 0; i < 64; i++)
 		memcpy(&dest[0] + i * row_bytes,
@@ -199,6 +416,8 @@ void restore_chip8_screen(const uint8_t *src)
 {
 	const uint8_t row_bytes = 128 / 8;
 
+	mark_all_rows();
+
 	// Light plane
 	for (short i = 0; i < 64; i++)
 		memcpy(GrayGetPlane(LIGHT_PLANE) + (i + Y_BASE) * 30 +
@@ -212,6 +431,83 @@ void restore_chip8_screen(const uint8_t *src)
 		       &src[1024] + i * row_bytes, row_bytes);
 }
 
+/*
+ * Returns the first byte of CHIP-8 row y (0-63) in the given plane. Window rows
+ * are 16 bytes long and always start on a word boundary, so they can be
+ * accessed as four long words.
+ */
+static inline uint32_t *window_row(void *lcd, short y)
+{
+	return lcd + (y + Y_BASE) * 30 + X_BASE / 8;
+}
+
+static inline void clear_window_row(uint32_t *row)
+{
+	row[0] = 0;
+	row[1] = 0;
+	row[2] = 0;
+	row[3] = 0;
+}
+
+static inline void copy_window_row(uint32_t *dest, const uint32_t *src)
+{
+	dest[0] = src[0];
+	dest[1] = src[1];
+	dest[2] = src[2];
+	dest[3] = src[3];
+}
+
+// The row number is mixed in so that the same pixels hash differently per row.
+static uint16_t hash_row(short y)
+{
+	const uint32_t *light = window_row(GrayGetPlane(LIGHT_PLANE), y);
+	const uint32_t *dark = window_row(GrayGetPlane(DARK_PLANE), y);
+	uint32_t h = y + 1;
+
+	for (short i = 0; i < 4; i++) {
+		h = (h << 5 | h >> 27) ^ light[i];
+		h = (h << 5 | h >> 27) ^ dark[i];
+	}
+
+	return h ^ h >> 16;
+}
+
+/*
+ * Returns a hash of both planes of the CHIP-8 window, rehashing only the rows
+ * that changed since the last call.
+ */
+uint16_t ch8_frame_hash(void)
+{
+	uint16_t h;
+
+	ch8_draw_list_flush();
+
+	for (short y = 0; y < 64; y++) {
+		if (!(dirty_rows[y / 32] >> (y % 32) & 1))
+			continue;
+
+		h = hash_row(y);
+		frame_hash += h - row_hashes[y];
+		row_hashes[y] = h;
+	}
+
+	dirty_rows[0] = 0;
+	dirty_rows[1] = 0;
+	return frame_hash;
+}
+
+/*
+ * 00E0 - Clears the 128x64 CHIP-8 window of one plane. Unlike clearing the
+ * whole plane, this leaves the border (and with it the sound indicator) alone.
+ */
+void ch8_clear_window(void *lcd)
+{
+	mark_all_rows();
+
+	for (short i = 0; i < 64; i++)
+		clear_window_row(window_row(lcd, i));
+}
+
 // Wrapped by ch8_scroll_right()
 static void _ch8_scroll_right(void *lcd)
 {
@@ -234,10 +530,18 @@ static void _ch8_scroll_right(void *lcd)
 // Wrapper around _ch8_scroll_right()
 void ch8_scroll_right(enum ch8_plane planes)
 {
+	uint8_t phase = ch8_profile_enter(PROFILE_DRAW);
+
+	ch8_draw_list_flush();
+	ch8_trace(TRACE_SCROLL);
+	mark_all_rows();
+
 	if (planes & C8_PLANE_LIGHT)
 		_ch8_scroll_right(GrayGetPlane(LIGHT_PLANE));
 	if (planes & C8_PLANE_DARK)
 		_ch8_scroll_right(GrayGetPlane(DARK_PLANE));
+
+	ch8_profile_enter(phase);
 }
 
 // Wrapped by ch8_scroll_left()
@@ -249,8 +553,8 @@ static void _ch8_scroll_left(void *lcd)
 
 	for (uint_fast8_t i = Y_BASE; i < Y_BASE + 64; i++) {
 		carry = 0;
-		for (uint_fast8_t j = (X_BASE + 128) / 8; j > X_BASE / 8;
-		     j -= 2) {
+		// The last word of the window down to the first, inclusive.
+		for (short j = (X_BASE + 128) / 8 - 2; j >= X_BASE / 8; j -= 2) {
 			ptr = lcd + i * 30 + j;
 			tmp = *ptr << 4 | carry;
 			carry = (*ptr & 0xF000) >> 12;
@@ -263,58 +567,92 @@ static void _ch8_scroll_left(void *lcd)
 // Wrapper around _ch8_scroll_left()
 void ch8_scroll_left(enum ch8_plane planes)
 {
+	uint8_t phase = ch8_profile_enter(PROFILE_DRAW);
+
+	ch8_draw_list_flush();
+	ch8_trace(TRACE_SCROLL);
+	mark_all_rows();
+
 	if (planes & C8_PLANE_LIGHT)
 		_ch8_scroll_left(GrayGetPlane(LIGHT_PLANE));
 	if (planes & C8_PLANE_DARK)
 		_ch8_scroll_left(GrayGetPlane(DARK_PLANE));
+
+	ch8_profile_enter(phase);
 }
 
 // Wrapped by ch8_scroll_down()
 static void _ch8_scroll_down(void *lcd, uint8_t n)
 {
-	memmove(lcd + (Y_BASE + n) * 30, lcd + Y_BASE * 30, 30 * (63 - n));
+	for (short i = 63; i >= n; i--)
+		copy_window_row(window_row(lcd, i), window_row(lcd, i - n));
 
-	for (uint8_t i = Y_BASE; i < Y_BASE + n; i++)
-		memset(lcd + i * 30 + X_BASE / 8, 0, 16);
+	for (short i = 0; i < n; i++)
+		clear_window_row(window_row(lcd, i));
 }
 
 // 00Cn - Scroll display n screen pixels down.
 // Wrapper around _ch8_scroll_down()
 void ch8_scroll_down(enum ch8_plane planes, uint16_t op)
 {
+	uint8_t phase = ch8_profile_enter(PROFILE_DRAW);
+
+	ch8_draw_list_flush();
+	ch8_trace(TRACE_SCROLL);
+	mark_all_rows();
+
 	if (planes & C8_PLANE_LIGHT)
 		_ch8_scroll_down(GrayGetPlane(LIGHT_PLANE), op & 0xF);
 	if (planes & C8_PLANE_DARK)
 		_ch8_scroll_down(GrayGetPlane(DARK_PLANE), op & 0xF);
+
+	ch8_profile_enter(phase);
 }
 
 // Wrapped by ch8_scroll_up()
 static void _ch8_scroll_up(void *lcd, uint8_t n)
 {
-	memmove(lcd + Y_BASE * 30, lcd + (Y_BASE + n) * 30, 30 * (63 - n));
+	for (short i = 0; i < 64 - n; i++)
+		copy_window_row(window_row(lcd, i), window_row(lcd, i + n));
 
-	for (uint_fast8_t i = Y_BASE + (63 - n); i < Y_BASE + 64; i++)
-		memset(lcd + i * 30 + X_BASE / 8, 0, 16);
+	for (short i = 64 - n; i < 64; i++)
+		clear_window_row(window_row(lcd, i));
 }
 
 // 00Dn - Scroll display n screen pixels up. (XO-CHIP)
 // Wrapper around _ch8_scroll_up()
 void ch8_scroll_up(enum ch8_plane planes, uint16_t op)
 {
+	uint8_t phase = ch8_profile_enter(PROFILE_DRAW);
+
+	ch8_draw_list_flush();
+	ch8_trace(TRACE_SCROLL);
+	mark_all_rows();
+
 	if (planes & C8_PLANE_LIGHT)
 		_ch8_scroll_up(GrayGetPlane(LIGHT_PLANE), op & 0xF);
 	if (planes & C8_PLANE_DARK)
 		_ch8_scroll_up(GrayGetPlane(DARK_PLANE), op & 0xF);
+
+	ch8_profile_enter(phase);
 }
 
+/*
+ * Fills everything outside of the CHIP-8 window. The window itself is never
+ * touched, and nothing but the sound indicator touches the border, so the
+ * border only needs to be rewritten when the sound timer starts or stops.
+ */
 static void _ch8_set_background(void *plane, short val)
 {
+	const short right = X_BASE / 8 + 128 / 8;
+
 	memset(plane, val, Y_BASE * 30);
 	for (short i = 0; i < 64; i++) {
-		memset(plane + Y_BASE * 30 + 30 * i, val, X_BASE / 8);
-		memset(plane + Y_BASE * 30 + 30 * i + 128 / 8 + 2, val, 2);
+		memset(plane + (Y_BASE + i) * 30, val, X_BASE / 8);
+		memset(plane + (Y_BASE + i) * 30 + right, val,
+		       LCD_WIDTH / 8 - right);
 	}
-	memset(plane + Y_BASE * 30 + 30 * 64, val,
+	memset(plane + (Y_BASE + 64) * 30, val,
 	       (LCD_HEIGHT - Y_BASE - 64) * 30);
 }
 
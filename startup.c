@@ -22,8 +22,10 @@
 #include <gray.h>
 #include <intr.h>
 #include <statline.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <system.h>
 #include <vat.h>
 
 /*
@@ -62,24 +64,35 @@ static const char CH8_TAG[] = { 0, 'c', 'h', '8', 0, OTH_TAG };
  */
 static volatile struct ch8_state *global_state;
 
+// Counts timer ticks, so that the main loop can tell when a frame has passed.
+volatile uint16_t ch8_ticks;
+
+// Set by ch8ti("bench"), which runs a benchmark in place of a game.
+static enum ch8_bench_mode bench_mode;
+
+// Whether the sound indicator is currently drawn.
+static volatile _Bool is_sound_on = FALSE;
+
 /*
- * This interrupt handler is called at just under 60hz. It is used to update the
- * timers at a constant rate and to display sound timer output. Options in
- * interrupt context are limited; avoid adding to this handler if you can.
+ * Updates the timers and displays sound timer output. In real time this is
+ * called at just under 60hz by timer_update_interrupt. In virtual time mode,
+ * ch8_run() calls it every tick_period instructions instead.
  */
-DEFINE_INT_HANDLER(timer_update_interrupt)
+void ch8_timer_tick(void)
 {
-	static volatile _Bool is_sound_on = FALSE;
-
 	uint8_t dtimer = global_state->delay_timer;
 	uint8_t stimer = global_state->sound_timer;
 
+	ch8_trace(TRACE_TIMER_TICK);
+
 	if (dtimer)
 		global_state->delay_timer = --dtimer;
 
 	if (stimer)
 		global_state->sound_timer = --stimer;
 
+	ch8_ticks++;
+
 	if (stimer && !is_sound_on) {
 		ch8_set_background();
 
@@ -91,6 +104,176 @@ DEFINE_INT_HANDLER(timer_update_interrupt)
 	}
 }
 
+#ifdef CH8_PROFILE
+volatile uint8_t ch8_profile_phase = PROFILE_IDLE;
+volatile unsigned long ch8_profile_samples[PROFILE_PHASES];
+
+#define profile_sample() (ch8_profile_samples[ch8_profile_phase]++)
+
+/*
+ * Virtual time runs don't need the timer interrupt, but the profiler still
+ * needs something to take its samples.
+ */
+DEFINE_INT_HANDLER(profile_interrupt)
+{
+	profile_sample();
+}
+
+#define IDLE_INT_HANDLER profile_interrupt
+
+static void start_profile(void)
+{
+	memset((void *)ch8_profile_samples, 0, sizeof(ch8_profile_samples));
+}
+
+static unsigned long profile_percent(enum ch8_profile_phase phase,
+				     unsigned long total)
+{
+	return ch8_profile_samples[phase] * 100 / total;
+}
+
+static void display_profile(void)
+{
+	unsigned long total = 0;
+	char msg[160];
+
+	for (uint8_t i = PROFILE_INTERPRET; i < PROFILE_PHASES; i++)
+		total += ch8_profile_samples[i];
+
+	if (!total)
+		return;
+
+	sprintf(msg,
+#ifdef CH8_FLAT_DECODE
+		"Decode: flat table\n"
+#else
+		"Decode: switch\n"
+#endif
+		"Samples: %lu\n"
+		"Interpret: %lu%%\n"
+		"Draw: %lu%%\n"
+		"Present: %lu%%\n"
+		"Keyboard: %lu%%",
+		total, profile_percent(PROFILE_INTERPRET, total),
+		profile_percent(PROFILE_DRAW, total),
+		profile_percent(PROFILE_PRESENT, total),
+		profile_percent(PROFILE_KEYS, total));
+
+	DlgMessage("Profile", msg, BT_NONE, BT_OK);
+}
+#else
+#define profile_sample()
+#define IDLE_INT_HANDLER DUMMY_HANDLER
+#define start_profile()
+#define display_profile()
+#endif
+
+/*
+ * This interrupt handler is called at just under 60hz. It is used to update the
+ * timers at a constant rate and to display sound timer output. Options in
+ * interrupt context are limited; avoid adding to ch8_timer_tick() if you can.
+ */
+DEFINE_INT_HANDLER(timer_update_interrupt)
+{
+	profile_sample();
+	ch8_timer_tick();
+}
+
+#ifdef STARTUP_TIMING
+/*
+ * Builds with -DSTARTUP_TIMING measure the time from _main to the first
+ * CHIP-8 instruction, split into the phases below, and display it once the
+ * game exits. Times come from FiftyMsecTick, so they have a resolution of
+ * 50ms. AMS updates it from AUTO_INT_5, which is why ch8_start() only
+ * replaces that vector right before calling ch8_run().
+ */
+enum startup_phase {
+	PHASE_ABOUT,
+	PHASE_SELECT,
+	PHASE_LOAD,
+	PHASE_LCD_SAVE,
+	PHASE_GRAY_ON,
+	PHASE_PRG,
+	PHASE_COUNT,
+};
+
+static unsigned long phase_mark;
+static unsigned long phase_ticks[PHASE_COUNT];
+
+static void start_phases(void)
+{
+	phase_mark = FiftyMsecTick;
+	memset(phase_ticks, 0, sizeof(phase_ticks));
+}
+
+// Charges the time since the last phase ended to the given phase.
+static void end_phase(enum startup_phase phase)
+{
+	unsigned long now = FiftyMsecTick;
+
+	phase_ticks[phase] += now - phase_mark;
+	phase_mark = now;
+}
+
+static void display_phases(void)
+{
+	char msg[160];
+
+	sprintf(msg,
+		"display_about: %lums\n"
+		"VarOpen/SymFind: %lums\n"
+		"load_dispatch: %lums\n"
+		"LCD_save: %lums\n"
+		"GrayOn: %lums\n"
+		"PRG setup: %lums",
+		phase_ticks[PHASE_ABOUT] * 50, phase_ticks[PHASE_SELECT] * 50,
+		phase_ticks[PHASE_LOAD] * 50, phase_ticks[PHASE_LCD_SAVE] * 50,
+		phase_ticks[PHASE_GRAY_ON] * 50, phase_ticks[PHASE_PRG] * 50);
+
+	DlgMessage("Startup time", msg, BT_NONE, BT_OK);
+}
+#else
+#define start_phases()
+#define end_phase(phase)
+#define display_phases()
+#endif
+
+#ifdef CH8_TRACE
+unsigned long ch8_trace_counts[TRACE_EVENTS];
+
+static void start_trace(void)
+{
+	memset(ch8_trace_counts, 0, sizeof(ch8_trace_counts));
+}
+
+static void display_trace(void)
+{
+	char msg[200];
+
+	sprintf(msg,
+		"Instructions: %lu\n"
+		"Draws: %lu\n"
+		"Collisions: %lu\n"
+		"Draw list flushes: %lu\n"
+		"Scrolls: %lu\n"
+		"Timer ticks: %lu\n"
+		"Keyboard reads: %lu\n"
+		"Error exits: %lu",
+		ch8_trace_counts[TRACE_STEP], ch8_trace_counts[TRACE_DRAW],
+		ch8_trace_counts[TRACE_COLLISION],
+		ch8_trace_counts[TRACE_DRAW_FLUSH],
+		ch8_trace_counts[TRACE_SCROLL],
+		ch8_trace_counts[TRACE_TIMER_TICK],
+		ch8_trace_counts[TRACE_KEY_READ],
+		ch8_trace_counts[TRACE_ERROR_EXIT]);
+
+	DlgMessage("Trace", msg, BT_NONE, BT_OK);
+}
+#else
+#define start_trace()
+#define display_trace()
+#endif
+
 /*
  * Get error message from error type enum. Note that identical return values are
  * constant folded.
@@ -102,6 +285,12 @@ static const char *get_error_message(enum ch8_error err)
 		return "Done";
 	case E_EXIT_SAVE:
 		return "Done";
+	case E_SWITCH_ROM:
+		return "Done";
+	case E_CHECKPOINT:
+		return "Done";
+	case E_REPLAY_VERIFIED:
+		return "Replay verified";
 	case E_SILENT_EXIT:
 		return "";
 	case E_INVALID_ARGUMENT:
@@ -120,6 +309,8 @@ static const char *get_error_message(enum ch8_error err)
 		return "Error: invalid instruction";
 	case E_INVALID_ADDRESS:
 		return "Error: address out of range";
+	case E_REPLAY_DIVERGED:
+		return "Error: replay diverged";
 	case E_UNKNOWN_ERR:
 	default:
 		return "Error: unknown error";
@@ -140,36 +331,8 @@ static void display_about(void)
 		   BT_NONE, BT_OK);
 }
 
-/* 
- * Provides a very simple LZSS decompressor for roms and savestates.
- *
- * Warning: will do funky things when the structure isn't as expected.
- * Only use for trusted inputs.
- */
-static uint16_t decompress(uint8_t *restrict dest, const uint8_t *restrict src,
-			   uint16_t srclen)
-{
-	uint16_t count = 0;
-	uint16_t offset;
-	uint16_t i = 0;
-
-	while (srclen > i) {
-		if (src[i] != 0xFF) {
-			dest[count++] = src[i++];
-		} else if (src[i + 1] & 63) {
-			for (uint8_t j = 0; j < (src[i + 1] & 63); j++) {
-				offset = (src[i + 1] & 0xC0) << 2 | src[i + 2];
-				dest[count + j] = dest[count + j - offset - 1];
-			}
-			count += src[i + 1] & 63;
-			i += 3;
-		} else {
-			dest[count++] = 0xFF;
-			i += 2;
-		}
-	}
-	return count;
-}
+static enum ch8_error switch_rom(struct ch8_state *state,
+				 INT_HANDLER old_int_1, INT_HANDLER int_5);
 
 /*
  * Initializes the saved screen, interrupts and the PRG, greyscale, 
@@ -178,10 +341,16 @@ static uint16_t decompress(uint8_t *restrict dest, const uint8_t *restrict src,
  * PRNG settings were found by trial and error with a handheld stopwatch.
  * (1, 241) = 62.5Hz, (0, 0) = 62.5Hz, and (1, 240) = 58.8Hz.
  * 
+ * In virtual time mode (tick_period != 0), the timer interrupt is not
+ * installed at all and ch8_run() ticks the timers itself.
+ *
+ * The state buffer is reused when the user switches roms with F2, so the
+ * environment is only restored once the final game exits.
+ *
  * Safety: can trigger heap compression; messes with interrupts and the
  * programable rate generator. See ch8_run() for more.
  */
-static enum ch8_error ch8_start(struct ch8_state *state)
+static enum ch8_error ch8_start(struct ch8_state *state, uint16_t tick_period)
 {
 	unsigned char old_prg_start;
 	enum ch8_error result;
@@ -198,10 +367,11 @@ static enum ch8_error ch8_start(struct ch8_state *state)
 
 	ClrScr();
 
+	end_phase(PHASE_LCD_SAVE);
+
 	old_int_1 = GetIntVec(AUTO_INT_1);
 	old_int_5 = GetIntVec(AUTO_INT_5);
 	SetIntVec(AUTO_INT_1, DUMMY_HANDLER);
-	SetIntVec(AUTO_INT_5, timer_update_interrupt);
 
 	if (!GrayOn())
 		return E_UNKNOWN_ERR;
@@ -209,6 +379,8 @@ static enum ch8_error ch8_start(struct ch8_state *state)
 	if (state->from_state)
 		restore_chip8_screen(state->display);
 
+	end_phase(PHASE_GRAY_ON);
+
 	if (!IsPRGEnabled())
 		EnablePRG();
 
@@ -219,7 +391,33 @@ static enum ch8_error ch8_start(struct ch8_state *state)
 	PRG_setRate(1);
 	PRG_setStart(240);
 
-	result = ch8_run(state);
+	// The timers are stopped until here, so this is done as late as possible.
+	SetIntVec(AUTO_INT_5,
+		  tick_period ? IDLE_INT_HANDLER : timer_update_interrupt);
+
+	end_phase(PHASE_PRG);
+
+	// F2 switches games, and replay verification moves on to the next
+	// segment, without tearing any of the above down.
+	while (TRUE) {
+		if (bench_mode != BENCH_OFF)
+			result = ch8_bench(state, bench_mode);
+		else
+			result = ch8_run(state, tick_period);
+
+		if (result == E_SWITCH_ROM)
+			result = switch_rom(state, old_int_1,
+					    GetIntVec(AUTO_INT_5));
+		else if (result == E_CHECKPOINT)
+			result = ch8_replay_check(state);
+		else
+			break;
+
+		if (result != E_OK)
+			break;
+	}
+
+	ch8_memo_free();
 
 	PRG_setRate(old_prg_rate);
 	PRG_setStart(old_prg_start);
@@ -239,13 +437,11 @@ static enum ch8_error ch8_start(struct ch8_state *state)
 }
 
 /*
- * Returns a new state from the given rom. randstate and display are left
- * uninitialized.
+ * Resets the state to that of an empty program, with only the font loaded.
+ * randstate and display are left uninitialized.
  */
-static enum ch8_error load_rom(const MULTI_EXPR *rom, struct ch8_state *state)
+static void new_state(struct ch8_state *state)
 {
-	const struct ch8_rom *pack;
-
 	*state = (struct ch8_state){
 		.version = { MAJOR_VERSION, MINOR_VERSION, PATCH_VERSION },
 		.stack = ch8_stack_new(),
@@ -262,6 +458,15 @@ static enum ch8_error load_rom(const MULTI_EXPR *rom, struct ch8_state *state)
 	};
 	memcpy(state->memory, CHIP8_SPRITES, sizeof(CHIP8_SPRITES));
 	randomize();
+}
+
+/*
+ * Returns a new state from the given rom. randstate and display are left
+ * uninitialized.
+ */
+static enum ch8_error load_rom(const MULTI_EXPR *rom, struct ch8_state *state)
+{
+	const struct ch8_rom *pack;
 
 	if (rom->Size - sizeof(pack->version) > 0x1000 - 0x200)
 		return E_ROM_LOAD;
@@ -272,13 +477,37 @@ static enum ch8_error load_rom(const MULTI_EXPR *rom, struct ch8_state *state)
 	    pack->version.minor > MINOR_VERSION)
 		return E_VERSION;
 
-	if (!decompress(state->memory + 0x200, pack->rom,
-			rom->Size - sizeof(pack->version)))
+	new_state(state);
+
+	if (!ch8_decompress_n(state->memory + 0x200, 0x1000 - 0x200, pack->rom,
+			      rom->Size - sizeof(pack->version)))
 		return E_ROM_LOAD;
 
 	return E_OK;
 }
 
+/*
+ * Savestates are stored compressed, unless that wouldn't make them any
+ * smaller. Compressed saves are always shorter than the state itself, so the
+ * two are told apart by their size, and uncompressed saves from older
+ * versions still load.
+ *
+ * Writes the state to dest, which needs room for twice its size, and returns
+ * the length written.
+ */
+static uint16_t pack_state(uint8_t *dest, const struct ch8_state *state)
+{
+	uint16_t len;
+
+	len = ch8_compress(dest, (const uint8_t *)state, sizeof(*state));
+	if (len >= sizeof(*state)) {
+		memcpy(dest, state, sizeof(*state));
+		len = sizeof(*state);
+	}
+
+	return len;
+}
+
 /*
  * Loads a snapshot of chip8 state from a pointer to a buffer,
  * validates said buffer, and returns an error if the buffer is invalid.
@@ -286,20 +515,26 @@ static enum ch8_error load_rom(const MULTI_EXPR *rom, struct ch8_state *state)
 static enum ch8_error load_state(const MULTI_EXPR *input,
 				 struct ch8_state *state)
 {
-	const struct ch8_state *rodata;
+	const struct ch8_version *version = (const void *)input->Expr;
+	uint16_t len = input->Size - sizeof(C8SV_TAG);
 
 	// The structs need to be the same for states.
-	if (input->Size - sizeof(C8SV_TAG) != sizeof(*rodata))
+	if (len == sizeof(*state)) {
+		if (version->major != MAJOR_VERSION ||
+		    version->minor > MINOR_VERSION)
+			return E_VERSION;
+		memcpy(state, input->Expr, sizeof(*state));
+	} else if (len > sizeof(*state) ||
+		 ch8_decompress_n((uint8_t *)state, sizeof(*state),
+				  input->Expr, len) != sizeof(*state))
 		return E_VERSION;
 
-	rodata = (struct ch8_state *)input->Expr;
-	if (rodata->version.major != MAJOR_VERSION ||
-	    rodata->version.minor > MINOR_VERSION)
+	if (state->version.major != MAJOR_VERSION ||
+	    state->version.minor > MINOR_VERSION)
 		return E_VERSION;
 
-	srand(rodata->randstate);
+	srand(state->randstate);
 
-	*state = *rodata;
 	state->from_state = TRUE;
 	return E_OK;
 }
@@ -324,14 +559,59 @@ static enum ch8_error load_dispatch(struct ch8_state *state, HSym handle)
 }
 
 /*
- * Attempts to load a file from user supplied arguments. Fails if more than one
- * argument is passed, or if the argument is not a valid file path.
+ * Sets up ch8ti("bench") or ch8ti("bench", "kernels"). arg points past the
+ * first argument.
+ */
+static enum ch8_error load_bench(struct ch8_state *state, ESI arg)
+{
+	if (ArgCount() == 1)
+		bench_mode = BENCH_ROMS;
+	else if (ArgCount() == 2 && GetArgType(arg) == STR_TAG &&
+		 !SymCmp(GetStrnArg(arg), "kernels"))
+		bench_mode = BENCH_KERNELS;
+	else
+		return E_INVALID_ARGUMENT;
+
+	new_state(state);
+	return E_OK;
+}
+
+/*
+ * Attempts to load a file from user supplied arguments. Fails if the first
+ * argument is not a valid file path.
+ *
+ * An optional second argument selects virtual time mode: timers tick every
+ * n instructions instead of at 60hz, so runs are independent of wall-clock
+ * time. e.g. ch8ti("cave", 200)
+ *
+ * A third argument records the run as a replay into a new variable,
+ * e.g. ch8ti("cave", 200, "caverun"). Replays are played back with
+ * ch8ti("caverun"), or from frame n onwards with ch8ti("caverun", n).
+ * ch8ti("caverun", "verify") checks that the replay reproduces every one of
+ * its keyframes.
+ *
+ * ch8ti("cave", "auto") runs in real time under the speed governor, which
+ * picks how many instructions to run per frame and shows it on exit. Passing
+ * that back in, e.g. ch8ti("cave", "auto", 30), starts the governor from it.
+ *
+ * ch8ti("cave", "clip") clips sprites at the edges of the screen instead of
+ * wrapping them, for S-CHIP roms. It can be combined with the governor, as in
+ * ch8ti("cave", "auto clip").
+ *
+ * ch8ti("bench") runs the built-in benchmark instead of a game. See bench.c.
  *
  * Safety: can trigger heap compression.
  */
-static enum ch8_error load_path(struct ch8_state *state)
+static enum ch8_error load_path(struct ch8_state *state,
+				uint16_t *tick_period)
 {
+	const char *record = NULL;
+	_Bool verify = FALSE;
+	_Bool govern = FALSE;
+	_Bool clip = FALSE;
 	ESI arg = top_estack;
+	unsigned long number = 0;
+	enum ch8_error result;
 	const char *str;
 	HSym handle;
 
@@ -340,6 +620,45 @@ static enum ch8_error load_path(struct ch8_state *state)
 
 	str = GetStrnArg(arg);
 
+	if (!SymCmp(str, "bench"))
+		return load_bench(state, arg);
+
+	if (ArgCount() >= 2 && GetArgType(arg) == STR_TAG) {
+		const char *mode = GetStrnArg(arg);
+
+		if (ArgCount() == 2 && !SymCmp(mode, "verify"))
+			verify = TRUE;
+		else if (!SymCmp(mode, "auto"))
+			govern = TRUE;
+		else if (!SymCmp(mode, "clip"))
+			clip = TRUE;
+		else if (!SymCmp(mode, "auto clip"))
+			govern = clip = TRUE;
+		else
+			return E_INVALID_ARGUMENT;
+	} else if (ArgCount() >= 2) {
+		if (GetArgType(arg) != POSINT_TAG)
+			return E_INVALID_ARGUMENT;
+
+		number = GetIntArg(arg);
+		if (number > UINT16_MAX)
+			return E_INVALID_ARGUMENT;
+	}
+
+	if (ArgCount() == 3 && (govern || clip)) {
+		if (!govern || GetArgType(arg) != POSINT_TAG)
+			return E_INVALID_ARGUMENT;
+
+		number = GetIntArg(arg);
+		if (number > UINT16_MAX)
+			return E_INVALID_ARGUMENT;
+	} else if (ArgCount() == 3) {
+		if (GetArgType(arg) != STR_TAG)
+			return E_INVALID_ARGUMENT;
+
+		record = GetStrnArg(arg);
+	}
+
 	if (!SymCmp(str, "about")) {
 		display_about();
 		return E_SILENT_EXIT;
@@ -350,30 +669,206 @@ static enum ch8_error load_path(struct ch8_state *state)
 	if (handle.folder == 0)
 		return E_INVALID_ARGUMENT;
 
-	return load_dispatch(state, handle);
+	end_phase(PHASE_SELECT);
+
+	if (ch8_is_replay(HeapDeref(DerefSym(handle)->handle))) {
+		if (record || govern || clip)
+			return E_INVALID_ARGUMENT;
+
+		return ch8_replay_play(handle, state, number, tick_period,
+				       verify);
+	}
+
+	if (verify || (!govern && !clip && ArgCount() >= 2 && number == 0))
+		return E_INVALID_ARGUMENT;
+
+	if (govern) {
+		ch8_governor_on = TRUE;
+		ch8_governor_limit = number;
+	} else {
+		*tick_period = number;
+	}
+
+	ch8_clip_sprites = clip;
+
+	result = load_dispatch(state, handle);
+
+	if (result == E_OK && record)
+		result = ch8_replay_record(record, *tick_period);
+
+	return result;
 }
 
 /*
- * Allows the user to select a rom or savestate to play.
+ * Makes the folder with the given name current. The name need not be
+ * terminated if it is 8 characters long, as in a SYM_ENTRY.
+ */
+static void set_folder(const char *name)
+{
+	char buf[10];
+
+	// SYMSTR() only works on literals, so build the tokenized name by hand.
+	buf[0] = 0;
+	strncpy(buf + 1, name, 8);
+	buf[9] = 0;
+
+	FolderCur((SYM_STR)(buf + 1 + strlen(buf + 1)), FALSE);
+}
+
+/*
+ * Makes the folder holding the last file picked from the dialog current again,
+ * so that the dialog opens where the user left off. Like the about dialog,
+ * this is only remembered while the program is unarchived. Returns whether the
+ * current folder was changed.
+ */
+static _Bool restore_last_folder(HANDLE *last_folder)
+{
+	SYM_ENTRY *folder;
+
+	if (*last_folder == H_NULL)
+		return FALSE;
+
+	// Folders are the symbols of the home folder.
+	for (folder = SymFindFirst(NULL, FO_NONE); folder;
+	     folder = SymFindNext()) {
+		if (folder->handle == *last_folder) {
+			set_folder(folder->name);
+			return TRUE;
+		}
+	}
+
+	// The folder was deleted.
+	*last_folder = H_NULL;
+	return FALSE;
+}
+
+/*
+ * Opens the file dialog for roms and savestates, starting in the folder of the
+ * file picked last time. Returns a zero folder if the dialog was cancelled.
  *
  * Safety: can trigger heap compression.
  */
-static enum ch8_error load_usermenu(struct ch8_state *state)
+static HSym select_file(void)
 {
+	static HANDLE last_folder = H_NULL;
+
+	char current[9];
+	_Bool moved;
 	HSym handle;
 
 	// Zero terminated list of possible file types.
 	const ESQ ftype_opts[] = { OTH_TAG, OTH_TAG, 0x00 };
 	const char *extensions[] = { "ch8", "c8sv" };
 
+	// The home screen's current folder is left as the user had it.
+	FolderGetCur(current);
+	moved = restore_last_folder(&last_folder);
+
 	handle = VarOpen(ftype_opts, extensions);
 
+	if (moved)
+		set_folder(current);
+
+	if (handle.folder != 0)
+		last_folder = handle.folder;
+
+	return handle;
+}
+
+/*
+ * Allows the user to select a rom or savestate to play.
+ *
+ * Safety: can trigger heap compression.
+ */
+static enum ch8_error load_usermenu(struct ch8_state *state)
+{
+	HSym handle = select_file();
+
 	if (handle.folder == 0)
 		return E_SILENT_EXIT;
 
+	end_phase(PHASE_SELECT);
+
 	return load_dispatch(state, handle);
 }
 
+// Clears both planes entirely, including the border.
+static void clear_planes(void)
+{
+	memset(GrayGetPlane(LIGHT_PLANE), 0, LCD_SIZE);
+	memset(GrayGetPlane(DARK_PLANE), 0, LCD_SIZE);
+	is_sound_on = FALSE;
+}
+
+/*
+ * Lets the user pick another rom or savestate while the PRG stays set up for
+ * the emulator. The timers are paused, and grayscale is turned off while the
+ * dialog is open, since its handler sits on the same interrupt that AMS needs
+ * back for the keyboard. If the dialog is cancelled, or the pick fails to
+ * load, the current game carries on.
+ *
+ * Safety: can trigger heap compression. Must only be called by ch8_start().
+ */
+static enum ch8_error switch_rom(struct ch8_state *state,
+				 INT_HANDLER old_int_1, INT_HANDLER int_5)
+{
+	struct ch8_state *next;
+	enum ch8_error result;
+	HSym handle;
+
+	save_chip8_screen(state->display);
+
+	SetIntVec(AUTO_INT_5, DUMMY_HANDLER);
+
+	// GrayOff() puts back the handler GrayOn() replaced, not the AMS one.
+	GrayOff();
+	SetIntVec(AUTO_INT_1, old_int_1);
+	ClrScr();
+
+	handle = select_file();
+
+	SetIntVec(AUTO_INT_1, DUMMY_HANDLER);
+	if (!GrayOn())
+		return E_UNKNOWN_ERR;
+
+	clear_planes();
+	SetIntVec(AUTO_INT_5, int_5);
+
+	if (handle.folder == 0) {
+		restore_chip8_screen(state->display);
+		return E_OK;
+	}
+
+	// Loaded on the side, so that a bad pick doesn't end the current game.
+	if (!(next = malloc(sizeof(*next))))
+		result = E_OOM;
+	else
+		result = load_dispatch(next, handle);
+
+	if (result != E_OK) {
+		free(next);
+		ST_helpMsg(get_error_message(result));
+		restore_chip8_screen(state->display);
+		return E_OK;
+	}
+
+	// Replays can't follow into another game.
+	if (ch8_replay_finish() != E_OK)
+		ST_helpMsg(get_error_message(E_OOM));
+
+	*state = *next;
+	free(next);
+
+	ch8_trace_start();
+	// Clip mode was asked for by the previous game, and isn't saved.
+	ch8_clip_sprites = FALSE;
+
+	if (state->from_state)
+		restore_chip8_screen(state->display);
+
+	return E_OK;
+}
+
 /*
  * Handles user dialogue and saving snapshots of emulator state.
  * 
@@ -381,10 +876,11 @@ static enum ch8_error load_usermenu(struct ch8_state *state)
  */
 static enum ch8_error save_state(const struct ch8_state *state)
 {
-	struct ch8_state *saved_state;
+	struct ch8_state *snapshot;
 	SYM_ENTRY *symbol;
 	MULTI_EXPR *file;
 	HANDLE handle;
+	uint16_t len;
 	HSym hsym;
 
 	const ESQ ftype_opts[] = { OTH_TAG, 0x00 };
@@ -395,30 +891,101 @@ static enum ch8_error save_state(const struct ch8_state *state)
 	if (hsym.folder == 0)
 		return E_SILENT_EXIT;
 
-	if (!(handle = HeapAlloc(2 + sizeof(struct ch8_state) +
-				 sizeof(C8SV_TAG))))
+	if (!(snapshot = malloc(sizeof(*snapshot))))
 		return E_OOM;
 
-	symbol = DerefSym(hsym);
-	symbol->handle = handle;
+	*snapshot = *state;
+	snapshot->randstate = __randseed;
+
+	if (!(handle = HeapAlloc(2 + 2 * sizeof(struct ch8_state) +
+				 sizeof(C8SV_TAG)))) {
+		free(snapshot);
+		return E_OOM;
+	}
 
 	file = HeapDeref(handle);
-	file->Size = sizeof(struct ch8_state) + sizeof(C8SV_TAG);
-	saved_state = (struct ch8_state *)file->Expr;
+	len = pack_state(file->Expr, snapshot);
+	file->Size = len + sizeof(C8SV_TAG);
 
-	*saved_state = *state;
+	// It's ugly but I need to manually place the type bytes at the end.
+	memcpy(file->Expr + len, C8SV_TAG, sizeof(C8SV_TAG));
 
-	saved_state->randstate = __randseed;
+	free(snapshot);
 
-	// It's ugly but I need to manually place the type bytes at the end.
-	memcpy((void *)saved_state + sizeof(struct ch8_state), C8SV_TAG,
-	       sizeof(C8SV_TAG));
+	// Gives back the room that compression didn't need.
+	HeapRealloc(handle, 2 + len + sizeof(C8SV_TAG));
 
-	// TODO: Compress save states. Previous attempts were too slow to use.
+	symbol = DerefSym(hsym);
+	symbol->handle = handle;
 
 	return E_OK;
 }
 
+/*
+ * F3 takes a quick save without leaving the game. The state is compressed
+ * straight into a new handle, which only replaces the variable once it is
+ * complete and tagged, so a quick save that fails leaves the previous one
+ * intact. Quick saves that run out of memory are dropped, as there is nowhere
+ * to report it mid-game.
+ */
+#define QUICKSAVE_NAME "ch8quick"
+
+/*
+ * Saves the state into the quick save variable. The screen and random seed are
+ * copied into the state first, as for a keyframe.
+ *
+ * Safety: can trigger heap compression.
+ */
+void ch8_quicksave(struct ch8_state *state)
+{
+	MULTI_EXPR *file;
+	HANDLE handle;
+	uint16_t len;
+
+	handle = HeapAlloc(2 + 2 * sizeof(*state) + sizeof(C8SV_TAG));
+	if (handle == H_NULL)
+		return;
+
+	save_chip8_screen(state->display);
+	state->randstate = __randseed;
+
+	file = HeapDeref(handle);
+	len = pack_state(file->Expr, state);
+	file->Size = len + sizeof(C8SV_TAG);
+	memcpy(file->Expr + len, C8SV_TAG, sizeof(C8SV_TAG));
+
+	HeapRealloc(handle, 2 + len + sizeof(C8SV_TAG));
+
+	ch8_store_var(SYMSTR(QUICKSAVE_NAME), handle);
+}
+
+/*
+ * Makes handle the contents of the variable name, creating it if needed, and
+ * replacing whatever it held before. The handle is freed if that fails.
+ *
+ * Safety: can trigger heap compression.
+ */
+void ch8_store_var(SYM_STR name, HANDLE handle)
+{
+	SYM_ENTRY *symbol = NULL;
+	HSym hsym;
+
+	hsym = SymFind(name);
+	if (hsym.folder == 0)
+		hsym = SymAdd(name);
+	if (hsym.folder != 0)
+		symbol = DerefSym(hsym);
+
+	// Archived variables can't have their handle swapped out.
+	if (symbol && !symbol->flags.bits.archived) {
+		if (symbol->handle != H_NULL)
+			HeapFree(symbol->handle);
+		symbol->handle = handle;
+	} else {
+		HeapFree(handle);
+	}
+}
+
 /*
  * The main function serves as an error handler and the location of the main
  * state struct. Also the entry point for the program.
@@ -429,14 +996,27 @@ void _main(void)
 	// This does not work for archived programs.
 	static _Bool has_been_run = FALSE;
 
+	uint16_t tick_period = 0;
 	struct ch8_state *state;
 	enum ch8_error result;
 
-	if (!has_been_run) {
+	bench_mode = BENCH_OFF;
+	ch8_governor_on = FALSE;
+	ch8_clip_sprites = FALSE;
+
+	start_phases();
+	start_trace();
+	start_profile();
+
+	// Launching a rom by name from the home screen should be instant, so the
+	// about dialog is only shown when the file dialog is going to be used.
+	if (!has_been_run && ArgCount() == 0) {
 		has_been_run = TRUE;
 		display_about();
 	}
 
+	end_phase(PHASE_ABOUT);
+
 	if (!(state = HLock(HeapAlloc(sizeof(struct ch8_state))))) {
 		ST_helpMsg(get_error_message(E_OOM));
 		return;
@@ -447,28 +1027,63 @@ void _main(void)
 		result = load_usermenu(state);
 		break;
 	case 1:
-		result = load_path(state);
+	case 2:
+	case 3:
+		result = load_path(state, &tick_period);
 		break;
 	default:
 		result = E_INVALID_ARGUMENT;
 	}
 
+	end_phase(PHASE_LOAD);
+
 	if (result != E_OK) {
 		if (result != E_SILENT_EXIT)
 			ST_helpMsg(get_error_message(result));
 		goto exit;
 	}
 
+	// Virtual time runs are reproducible, so the seed has to be too.
+	if (tick_period && !state->from_state)
+		srand(0);
+
 	global_state = state;
 
-	result = ch8_start(state);
-	if (result != E_SILENT_EXIT)
+	ch8_trace_start();
+	result = ch8_start(state, tick_period);
+
+	display_phases();
+	display_trace();
+	ch8_trace_finish(state);
+	display_profile();
+
+	if (bench_mode != BENCH_OFF && result == E_OK)
+		ch8_bench_report();
+
+	if (result == E_REPLAY_DIVERGED) {
+		char msg[40];
+
+		sprintf(msg, "Error: replay diverged by frame %u",
+			ch8_replay_diverged);
+		ST_helpMsg(msg);
+	} else if (ch8_governor_on && ch8_governor_limit &&
+		   result <= E_SILENT_EXIT) {
+		char msg[40];
+
+		sprintf(msg, "Speed: %u instructions per frame",
+			ch8_governor_limit);
+		ST_helpMsg(msg);
+	} else if (result != E_SILENT_EXIT) {
 		ST_helpMsg(get_error_message(result));
+	}
 
 	if (result == E_EXIT_SAVE)
 		save_state(state);
 
 exit:
+	if (ch8_replay_finish() != E_OK)
+		ST_helpMsg(get_error_message(E_OOM));
+
 	HeapFree(HeapPtrToHandle(state));
 	return;
 }
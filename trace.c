@@ -0,0 +1,177 @@
+/* Copyright (C) 2022-2024 Peter Lafreniere
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chip8.h"
+#include <alloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vat.h>
+
+#ifdef CH8_TRACE
+
+/*
+ * Trace builds also capture the rom's own control flow: how many times each
+ * instruction ran, and how many times control went from one instruction to
+ * anything other than the next one. A full instruction trace would fill the
+ * heap within seconds, while these counts are enough to rebuild every basic
+ * block and loop along with its dynamic instruction count, and to count every
+ * pair of opcodes that ran back to back. On exit they are stored in the
+ * ch8trace variable, for "ch8ti-prep --trace" to analyse.
+ *
+ * Memoization and Fx0A speculation are off in trace builds, as replayed
+ * routines would never reach ch8_trace_pc(), and rolled back steps would be
+ * counted as if they ran.
+ *
+ * A c8tr variable holds a struct ch8_trace_file with edge_count edges, and the
+ * tag. Memory is copied on exit, so code that rewrites itself is analysed as
+ * it was left.
+ */
+#define TRACE_NAME "ch8trace"
+#define TRACE_EDGES 512
+
+static const char C8TR_TAG[] = { 0, 'c', '8', 't', 'r', 0, OTH_TAG };
+
+struct ch8_trace_edge {
+	uint16_t from;
+	uint16_t to;
+	uint32_t count;
+};
+
+struct ch8_trace_file {
+	uint8_t memory[4096];
+	_Bool is_hires_on;
+	uint8_t fill;
+	uint32_t counts[2048]; // Indexed by pc / 2.
+	uint32_t odd_pcs; // Instructions run from odd addresses, not in counts.
+	uint32_t lost_edges; // Taken after the edge table filled up.
+	uint16_t edge_count;
+	struct ch8_trace_edge edges[];
+};
+
+// Edges are an open-addressed hash table until the file is written.
+static struct ch8_trace_file *trace = NULL;
+static uint16_t trace_last_pc;
+
+#define TRACE_SIZE \
+	(sizeof(struct ch8_trace_file) + \
+	 TRACE_EDGES * sizeof(struct ch8_trace_edge))
+
+/*
+ * Starts capturing, once a game has loaded. Called again when F2 loads another
+ * game, which starts the capture over, as the counts are only meaningful
+ * against the memory of a single rom.
+ */
+void ch8_trace_start(void)
+{
+	if (trace)
+		memset(trace, 0, TRACE_SIZE);
+	else
+		trace = calloc(1, TRACE_SIZE);
+	trace_last_pc = 0xFFFF;
+}
+
+/*
+ * Called each time run_loop() starts. The state may have been replaced since
+ * the last instruction, as after a replay checkpoint, so the jump to the new
+ * pc isn't counted as an edge.
+ */
+void ch8_trace_resume(void)
+{
+	trace_last_pc = 0xFFFF;
+}
+
+static void trace_edge(uint16_t from, uint16_t to)
+{
+	uint16_t i = ((from << 3) ^ to) % TRACE_EDGES;
+	uint16_t probes;
+
+	for (probes = 0; probes < TRACE_EDGES; probes++) {
+		struct ch8_trace_edge *edge = &trace->edges[i];
+
+		if (edge->count == 0) {
+			edge->from = from;
+			edge->to = to;
+		}
+		if (edge->from == from && edge->to == to) {
+			edge->count++;
+			return;
+		}
+		i = (i + 1) % TRACE_EDGES;
+	}
+
+	trace->lost_edges++;
+}
+
+/*
+ * Counts the instruction at pc, which has been checked to be in memory, and
+ * the edge that led to it if it didn't follow the previous one. Edges keep
+ * their exact addresses, but odd pcs are only counted as a total, as they
+ * would otherwise share a count with the even pc before them.
+ */
+void ch8_trace_pc(uint16_t pc)
+{
+	if (!trace)
+		return;
+
+	if (pc & 1)
+		trace->odd_pcs++;
+	else
+		trace->counts[pc >> 1]++;
+	if (trace_last_pc != 0xFFFF && pc != trace_last_pc + 2)
+		trace_edge(trace_last_pc, pc);
+	trace_last_pc = pc;
+}
+
+/*
+ * Writes the capture to the ch8trace variable and frees it.
+ *
+ * Safety: can trigger heap compression.
+ */
+void ch8_trace_finish(const struct ch8_state *state)
+{
+	MULTI_EXPR *var;
+	uint16_t len, i;
+	HANDLE handle;
+
+	if (!trace)
+		return;
+
+	memcpy(trace->memory, state->memory, sizeof(trace->memory));
+	trace->is_hires_on = state->is_hires_on;
+
+	// Pack the used edges at the front of the table.
+	for (i = 0; i < TRACE_EDGES; i++)
+		if (trace->edges[i].count)
+			trace->edges[trace->edge_count++] = trace->edges[i];
+
+	len = sizeof(*trace) +
+	      trace->edge_count * sizeof(struct ch8_trace_edge);
+
+	if ((handle = HeapAlloc(2 + len + sizeof(C8TR_TAG))) != H_NULL) {
+		var = HeapDeref(handle);
+		var->Size = len + sizeof(C8TR_TAG);
+		memcpy(var->Expr, trace, len);
+		memcpy(var->Expr + len, C8TR_TAG, sizeof(C8TR_TAG));
+
+		ch8_store_var(SYMSTR(TRACE_NAME), handle);
+	}
+
+	free(trace);
+	trace = NULL;
+}
+
+#endif /* CH8_TRACE */